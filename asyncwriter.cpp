@@ -5,7 +5,7 @@
 #include "fileio.h"
 
 AsyncWriter::AsyncWriter(QObject *parent) :
-    QThread(parent), abort(false), waiting(false)
+    QThread(parent), abort(false), waiting(false), compressionLevel(-1), compressionThreads(1)
 {
 }
 
@@ -33,6 +33,14 @@ void AsyncWriter::writeData(const QList<ScribblePage> &data, const QFile &file)
     }
 }
 
+void AsyncWriter::setCompression(int level, int threads)
+{
+    QMutexLocker locker(&mutex);
+
+    compressionLevel = level;
+    compressionThreads = threads;
+}
+
 void AsyncWriter::stopWriting()
 {
     QMutexLocker locker(&mutex);
@@ -43,6 +51,11 @@ void AsyncWriter::stopWriting()
         workFinished.wait(&mutex, 3000);
 }
 
+void AsyncWriter::xmlFragmentComputed(int page, int revision, const QByteArray &xml)
+{
+    emit pageXmlComputed(page, revision, xml);
+}
+
 void AsyncWriter::run()
 {
     forever {
@@ -50,6 +63,8 @@ void AsyncWriter::run()
         QFile f;
         f.setFileName(file.fileName());
         const QList<ScribblePage> d = data;
+        int level = compressionLevel;
+        int threads = compressionThreads;
         mutex.unlock();
 
         if (abort) {
@@ -58,8 +73,14 @@ void AsyncWriter::run()
         }
 
         if (!f.fileName().isEmpty()) {
-            QByteArray output = ScribbleDocument::toXournalXMLFormat(d);
-            FileIO::writeGZFileLocked(f, output);
+            GZFileWriter writer(f, level, threads);
+            bool success = false;
+            /* a partly written document must not replace the file */
+            if (ScribbleDocument::writeXournalFile(d, writer, this))
+                success = writer.close();
+            else
+                writer.abort();
+            emit documentWritten(f.fileName(), success, writer.checksum());
         }
 
         mutex.lock();
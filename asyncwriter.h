@@ -12,7 +12,7 @@
 /* Thread that is used to write data to a file asynchronously.
  * At any time, there is at most one writing operation pending
  * and any operation is allowed to fail. */
-class AsyncWriter : public QThread
+class AsyncWriter : public QThread, private ScribbleXmlFragmentReceiver
 {
     Q_OBJECT
 public:
@@ -20,18 +20,32 @@ public:
     ~AsyncWriter();
 
     void writeData(const QList<ScribblePage> &data, const QFile &file);
+    /* level is 0 to 9 or -1 for the zlib default, more than one thread
+     * compresses blocks in parallel, used from the next write on */
+    void setCompression(int level, int threads);
     void stopWriting();
 
 signals:
+    /* The XML representation of a page was computed during the write,
+     * emitted as soon as the page is written, can be fed back to
+     * ScribbleDocument::setPageXmlCache. */
+    void pageXmlComputed(int page, int revision, const QByteArray &xml);
+    /* checksum is the CRC-32 of the uncompressed document */
+    void documentWritten(const QString &fileName, bool success, uint checksum);
 
 protected:
     void run();
 
 private:
+    /* called in the writer thread, emits pageXmlComputed */
+    void xmlFragmentComputed(int page, int revision, const QByteArray &xml);
+
     bool abort;
     bool waiting;
     QFile file;
     QList<ScribblePage> data;
+    int compressionLevel;
+    int compressionThreads;
 
     QMutex mutex;
     QWaitCondition workToDo;
@@ -0,0 +1,181 @@
+/*
+ * scribble: Scribbling Application for Onyx Boox M92
+ *
+ * Copyright (C) 2012 peter-x
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "coordinate_codec.h"
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+/* powers of ten that are exactly representable as double */
+static const double exactPowersOfTen[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+bool CoordinateCodec::parsePoints(const char *begin, const char *end, QVector<float> *xs, QVector<float> *ys)
+{
+    /* first pass: validate and count, so the output is allocated once */
+    int numbers = 0;
+    bool inNumber = false;
+    for (const char *p = begin; p < end; p ++) {
+        if (isNumberChar(*p)) {
+            if (!inNumber)
+                numbers ++;
+            inNumber = true;
+        } else if (isSeparator(*p)) {
+            inNumber = false;
+        } else {
+            return false;
+        }
+    }
+
+    int n = numbers / 2;
+    xs->resize(n);
+    ys->resize(n);
+    float *x = xs->data();
+    float *y = ys->data();
+    const char *p = begin;
+    for (int i = 0; i < 2 * n; i ++) {
+        while (p < end && isSeparator(*p))
+            p ++;
+        const char *numberBegin = p;
+        while (p < end && isNumberChar(*p))
+            p ++;
+        float v = parseNumber(numberBegin, p);
+        if (i % 2 == 0)
+            x[i / 2] = v;
+        else
+            y[i / 2] = v;
+    }
+    return true;
+}
+
+float CoordinateCodec::parseNumber(const char *begin, const char *end)
+{
+    /* Fast path for [+-]digits[.digits] with at most 15 significant
+     * digits, which covers everything written by "%.2f". The mantissa
+     * and the power of ten are exact doubles, so the division is
+     * correctly rounded and gives the same double as strtod. */
+    const char *p = begin;
+    bool negative = false;
+    if (p < end && (*p == '+' || *p == '-')) {
+        negative = (*p == '-');
+        p ++;
+    }
+    quint64 mantissa = 0;
+    int digits = 0;
+    int fractionDigits = 0;
+    while (p < end && '0' <= *p && *p <= '9') {
+        mantissa = mantissa * 10 + (*p - '0');
+        if (mantissa != 0)
+            digits ++;
+        p ++;
+    }
+    bool anyDigit = (p > begin + (negative || *begin == '+' ? 1 : 0));
+    if (p < end && *p == '.') {
+        p ++;
+        while (p < end && '0' <= *p && *p <= '9') {
+            mantissa = mantissa * 10 + (*p - '0');
+            if (mantissa != 0)
+                digits ++;
+            fractionDigits ++;
+            anyDigit = true;
+            p ++;
+        }
+    }
+    if (p == end && anyDigit && digits <= 15 && fractionDigits <= 22) {
+        double value = double(mantissa) / exactPowersOfTen[fractionDigits];
+        return float(negative ? -value : value);
+    }
+
+    /* exponents, very long numbers and malformed input */
+    return QByteArray(begin, end - begin).toFloat();
+}
+
+void CoordinateCodec::appendPoints(QByteArray &output, const float *x, const float *y, int n)
+{
+    int pos = output.size();
+    /* typical length of a point, grown below if necessary */
+    output.resize(pos + n * 14);
+    for (int i = 0; i < n; i ++) {
+        if (output.size() - pos < 2 * maxFormattedLength + 2)
+            output.resize(pos + (n - i) * 14 + 2 * maxFormattedLength + 2);
+        char *out = output.data() + pos;
+        int length = formatCoordinate(x[i], out);
+        out[length ++] = ' ';
+        length += formatCoordinate(y[i], out + length);
+        out[length ++] = ' ';
+        pos += length;
+    }
+    output.resize(pos);
+}
+
+int CoordinateCodec::formatCoordinate(float v, char *out)
+{
+    quint32 bits;
+    memcpy(&bits, &v, sizeof(bits));
+    bool negative = (bits >> 31) != 0;
+    double value = v;
+    if (value != value) {
+        memcpy(out, negative ? "-nan" : "nan", negative ? 4 : 3);
+        return negative ? 4 : 3;
+    }
+
+    int length = 0;
+    if (negative) {
+        out[length ++] = '-';
+        value = -value;
+    }
+    if (value > std::numeric_limits<float>::max()) {
+        memcpy(out + length, "inf", 3);
+        return length + 3;
+    }
+
+    /* A float has 24 significant bits and 100 needs 7, so the product is
+     * exact. Rounding it to an integer (to nearest, ties to even, like
+     * printf does on the exact decimal value) gives the digits. */
+    double scaled = value * 100;
+    if (scaled >= 9.0e18) {
+        /* does not fit into 64 bits, but is an integer anyway */
+        QByteArray digits = QByteArray::number(value, 'f', 2);
+        memcpy(out + length, digits.constData(), digits.size());
+        return length + digits.size();
+    }
+    double hundredths = floor(scaled);
+    double fraction = scaled - hundredths;
+    if (fraction > 0.5 || (fraction == 0.5 && fmod(hundredths, 2) != 0))
+        hundredths += 1;
+
+    quint64 n = quint64(hundredths);
+    char digits[24];
+    int numDigits = 0;
+    quint64 integerPart = n / 100;
+    do {
+        digits[numDigits ++] = char('0' + integerPart % 10);
+        integerPart /= 10;
+    } while (integerPart != 0);
+    while (numDigits > 0)
+        out[length ++] = digits[-- numDigits];
+    out[length ++] = '.';
+    out[length ++] = char('0' + (n / 10) % 10);
+    out[length ++] = char('0' + n % 10);
+    return length;
+}
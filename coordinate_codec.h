@@ -0,0 +1,57 @@
+/*
+ * scribble: Scribbling Application for Onyx Boox M92
+ *
+ * Copyright (C) 2012 peter-x
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef COORDINATE_CODEC_H
+#define COORDINATE_CODEC_H
+
+#include <QByteArray>
+#include <QVector>
+
+/* Conversion between stroke coordinates and the whitespace separated
+ * text used in the <stroke> elements of Xournal files. */
+class CoordinateCodec
+{
+public:
+    /* Parses the coordinates "x1 y1 x2 y2 ..." into xs and ys, a trailing
+     * x without y is dropped. The numbers are converted exactly like
+     * QByteArray::toFloat does, invalid numbers become 0. Returns false
+     * if the text contains characters other than numbers and the
+     * separators ' ', '\n' and '\r'. */
+    static bool parsePoints(const char *begin, const char *end, QVector<float> *xs, QVector<float> *ys);
+
+    /* Appends "x y " for each point, the numbers formatted byte-identical
+     * to printf("%.2f") in the C locale, independent of the locale of
+     * the process. */
+    static void appendPoints(QByteArray &output, const float *x, const float *y, int n);
+    /* Writes v formatted like "%.2f" to out and returns the number of
+     * characters, at most maxFormattedLength. out is not terminated. */
+    static int formatCoordinate(float v, char *out);
+
+    static const int maxFormattedLength = 48;
+
+private:
+    static bool isNumberChar(char c) {
+        return ('0' <= c && c <= '9') || c == '.' || c == '+' || c == '-' || c == 'e' || c == 'E';
+    }
+    static bool isSeparator(char c) { return c == ' ' || c == '\n' || c == '\r'; }
+    static float parseNumber(const char *begin, const char *end);
+};
+
+#endif // COORDINATE_CODEC_H
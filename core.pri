@@ -0,0 +1,38 @@
+# Document, file formats and rendering, without the Onyx SDK and without
+# widgets. Used by scribble.pro and tool/scribble-tool.pro.
+
+QT += core gui xml
+
+INCLUDEPATH += $$PWD
+DEPENDPATH += $$PWD
+
+SOURCES += \
+    $$PWD/scribble_document.cpp \
+    $$PWD/fileio.cpp \
+    $$PWD/asyncwriter.cpp \
+    $$PWD/scribble_journal.cpp \
+    $$PWD/xournal_parser.cpp \
+    $$PWD/coordinate_codec.cpp \
+    $$PWD/eraser_kernel.cpp \
+    $$PWD/tile_cache.cpp \
+    $$PWD/span_rasterizer.cpp \
+    $$PWD/scribble_history.cpp \
+    $$PWD/native_format.cpp \
+    $$PWD/scribble_graphics_context.cpp
+
+HEADERS += \
+    $$PWD/scribble_document.h \
+    $$PWD/filelocker.h \
+    $$PWD/fileio.h \
+    $$PWD/asyncwriter.h \
+    $$PWD/scribble_journal.h \
+    $$PWD/xournal_parser.h \
+    $$PWD/coordinate_codec.h \
+    $$PWD/eraser_kernel.h \
+    $$PWD/tile_cache.h \
+    $$PWD/span_rasterizer.h \
+    $$PWD/scribble_history.h \
+    $$PWD/native_format.h \
+    $$PWD/scribble_graphics_context.h
+
+LIBS += -lz
@@ -0,0 +1,307 @@
+/*
+ * scribble: Scribbling Application for Onyx Boox M92
+ *
+ * Copyright (C) 2012 peter-x
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "eraser_kernel.h"
+
+#include <cmath>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define ERASER_KERNEL_SIMD
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define ERASER_KERNEL_SIMD
+#endif
+
+/* All tests avoid divisions (NEON has none) and use the same operations
+ * in the scalar and in the vector versions.
+ *
+ * The distance of p to the segment a-b is at most r if one of the end
+ * points is within r or if the projection of p falls inside of the
+ * segment and the distance to the line is within r:
+ *   0 < (p - a).(b - a) < |b - a|^2  and  ((p - a) x (b - a))^2 <= r^2 |b - a|^2
+ *
+ * Two segments are closer than r if they cross or if one of the four
+ * end points is closer than r to the other segment. */
+
+static inline bool pointNearSegment(float px, float py, float ax, float ay, float bx, float by, float r2)
+{
+    float wx = px - ax, wy = py - ay;
+    float ex = px - bx, ey = py - by;
+    if (wx * wx + wy * wy <= r2 || ex * ex + ey * ey <= r2)
+        return true;
+    float dx = bx - ax, dy = by - ay;
+    float wd = wx * dx + wy * dy;
+    float dd = dx * dx + dy * dy;
+    float cr = wx * dy - wy * dx;
+    return wd > 0 && wd < dd && cr * cr <= r2 * dd;
+}
+
+static inline bool segmentsCross(float ax, float ay, float bx, float by,
+                                 float cx, float cy, float dx, float dy)
+{
+    float ux = bx - ax, uy = by - ay;
+    float o1 = ux * (cy - ay) - uy * (cx - ax);
+    float o2 = ux * (dy - ay) - uy * (dx - ax);
+    float vx = dx - cx, vy = dy - cy;
+    float o3 = vx * (ay - cy) - vy * (ax - cx);
+    float o4 = vx * (by - cy) - vy * (bx - cx);
+    return ((o1 < 0 && o2 > 0) || (o1 > 0 && o2 < 0)) &&
+            ((o3 < 0 && o4 > 0) || (o3 > 0 && o4 < 0));
+}
+
+static inline bool segmentNearSegment(float ax, float ay, float bx, float by,
+                                      float cx, float cy, float dx, float dy, float r2)
+{
+    return pointNearSegment(cx, cy, ax, ay, bx, by, r2) ||
+            pointNearSegment(dx, dy, ax, ay, bx, by, r2) ||
+            pointNearSegment(ax, ay, cx, cy, dx, dy, r2) ||
+            pointNearSegment(bx, by, cx, cy, dx, dy, r2) ||
+            segmentsCross(ax, ay, bx, by, cx, cy, dx, dy);
+}
+
+#if defined(ERASER_KERNEL_SIMD)
+
+/* four lanes of floats and of comparison results */
+#if defined(__SSE2__)
+typedef __m128 Vec;
+typedef __m128 Mask;
+static inline Vec load(const float *p) { return _mm_loadu_ps(p); }
+static inline Vec splat(float v) { return _mm_set1_ps(v); }
+static inline Vec add(Vec a, Vec b) { return _mm_add_ps(a, b); }
+static inline Vec sub(Vec a, Vec b) { return _mm_sub_ps(a, b); }
+static inline Vec mul(Vec a, Vec b) { return _mm_mul_ps(a, b); }
+static inline Mask lessEqual(Vec a, Vec b) { return _mm_cmple_ps(a, b); }
+static inline Mask less(Vec a, Vec b) { return _mm_cmplt_ps(a, b); }
+static inline Mask maskAnd(Mask a, Mask b) { return _mm_and_ps(a, b); }
+static inline Mask maskOr(Mask a, Mask b) { return _mm_or_ps(a, b); }
+static inline int maskBits(Mask m) { return _mm_movemask_ps(m); }
+#else
+typedef float32x4_t Vec;
+typedef uint32x4_t Mask;
+static inline Vec load(const float *p) { return vld1q_f32(p); }
+static inline Vec splat(float v) { return vdupq_n_f32(v); }
+static inline Vec add(Vec a, Vec b) { return vaddq_f32(a, b); }
+static inline Vec sub(Vec a, Vec b) { return vsubq_f32(a, b); }
+static inline Vec mul(Vec a, Vec b) { return vmulq_f32(a, b); }
+static inline Mask lessEqual(Vec a, Vec b) { return vcleq_f32(a, b); }
+static inline Mask less(Vec a, Vec b) { return vcltq_f32(a, b); }
+static inline Mask maskAnd(Mask a, Mask b) { return vandq_u32(a, b); }
+static inline Mask maskOr(Mask a, Mask b) { return vorrq_u32(a, b); }
+static inline int maskBits(Mask m) {
+    return (vgetq_lane_u32(m, 0) & 1) | (vgetq_lane_u32(m, 1) & 2) |
+            (vgetq_lane_u32(m, 2) & 4) | (vgetq_lane_u32(m, 3) & 8);
+}
+#endif
+
+static inline Mask pointNearSegment(Vec px, Vec py, Vec ax, Vec ay, Vec bx, Vec by, Vec r2)
+{
+    Vec wx = sub(px, ax), wy = sub(py, ay);
+    Vec ex = sub(px, bx), ey = sub(py, by);
+    Mask nearEnd = maskOr(lessEqual(add(mul(wx, wx), mul(wy, wy)), r2),
+                          lessEqual(add(mul(ex, ex), mul(ey, ey)), r2));
+    Vec dx = sub(bx, ax), dy = sub(by, ay);
+    Vec wd = add(mul(wx, dx), mul(wy, dy));
+    Vec dd = add(mul(dx, dx), mul(dy, dy));
+    Vec cr = sub(mul(wx, dy), mul(wy, dx));
+    Mask inside = maskAnd(less(splat(0), wd), less(wd, dd));
+    return maskOr(nearEnd, maskAnd(inside, lessEqual(mul(cr, cr), mul(r2, dd))));
+}
+
+static inline Mask oppositeSigns(Vec a, Vec b)
+{
+    Vec zero = splat(0);
+    return maskOr(maskAnd(less(a, zero), less(zero, b)),
+                  maskAnd(less(zero, a), less(b, zero)));
+}
+
+static inline Mask segmentsCross(Vec ax, Vec ay, Vec bx, Vec by, Vec cx, Vec cy, Vec dx, Vec dy)
+{
+    Vec ux = sub(bx, ax), uy = sub(by, ay);
+    Vec o1 = sub(mul(ux, sub(cy, ay)), mul(uy, sub(cx, ax)));
+    Vec o2 = sub(mul(ux, sub(dy, ay)), mul(uy, sub(dx, ax)));
+    Vec vx = sub(dx, cx), vy = sub(dy, cy);
+    Vec o3 = sub(mul(vx, sub(ay, cy)), mul(vy, sub(ax, cx)));
+    Vec o4 = sub(mul(vx, sub(by, cy)), mul(vy, sub(bx, cx)));
+    return maskAnd(oppositeSigns(o1, o2), oppositeSigns(o3, o4));
+}
+
+#endif // ERASER_KERNEL_SIMD
+
+static inline int storeBits(int bits, quint8 *hit)
+{
+    hit[0] = bits & 1;
+    hit[1] = (bits >> 1) & 1;
+    hit[2] = (bits >> 2) & 1;
+    hit[3] = (bits >> 3) & 1;
+    return hit[0] + hit[1] + hit[2] + hit[3];
+}
+
+int EraserKernel::segmentsNearPoint(const float *x, const float *y, int n,
+                                    float px, float py, float radius, quint8 *hit)
+{
+    float r2 = radius * radius;
+    if (n <= 0)
+        return 0;
+    if (n == 1) {
+        hit[0] = pointNearSegment(px, py, x[0], y[0], x[0], y[0], r2);
+        return hit[0];
+    }
+
+    int segments = n - 1;
+    int hits = 0;
+    int i = 0;
+#if defined(ERASER_KERNEL_SIMD)
+    Vec vpx = splat(px), vpy = splat(py), vr2 = splat(r2);
+    for (; i + 4 <= segments; i += 4) {
+        Mask m = pointNearSegment(vpx, vpy, load(x + i), load(y + i),
+                                  load(x + i + 1), load(y + i + 1), vr2);
+        hits += storeBits(maskBits(m), hit + i);
+    }
+#endif
+    for (; i < segments; i ++) {
+        hit[i] = pointNearSegment(px, py, x[i], y[i], x[i + 1], y[i + 1], r2);
+        hits += hit[i];
+    }
+    return hits;
+}
+
+int EraserKernel::segmentsNearSegment(const float *x, const float *y, int n,
+                                      float ax, float ay, float bx, float by, float radius, quint8 *hit)
+{
+    float r2 = radius * radius;
+    if (n <= 0)
+        return 0;
+    if (n == 1) {
+        hit[0] = pointNearSegment(x[0], y[0], ax, ay, bx, by, r2);
+        return hit[0];
+    }
+
+    int segments = n - 1;
+    int hits = 0;
+    int i = 0;
+#if defined(ERASER_KERNEL_SIMD)
+    Vec vax = splat(ax), vay = splat(ay), vbx = splat(bx), vby = splat(by), vr2 = splat(r2);
+    for (; i + 4 <= segments; i += 4) {
+        Vec cx = load(x + i), cy = load(y + i);
+        Vec dx = load(x + i + 1), dy = load(y + i + 1);
+        Mask m = maskOr(maskOr(pointNearSegment(vax, vay, cx, cy, dx, dy, vr2),
+                               pointNearSegment(vbx, vby, cx, cy, dx, dy, vr2)),
+                        maskOr(maskOr(pointNearSegment(cx, cy, vax, vay, vbx, vby, vr2),
+                                      pointNearSegment(dx, dy, vax, vay, vbx, vby, vr2)),
+                               segmentsCross(vax, vay, vbx, vby, cx, cy, dx, dy)));
+        hits += storeBits(maskBits(m), hit + i);
+    }
+#endif
+    for (; i < segments; i ++) {
+        hit[i] = segmentNearSegment(ax, ay, bx, by, x[i], y[i], x[i + 1], y[i + 1], r2);
+        hits += hit[i];
+    }
+    return hits;
+}
+
+bool EraserKernel::clipSegmentToCircle(qreal ax, qreal ay, qreal bx, qreal by,
+                                       qreal px, qreal py, qreal radius, qreal *t0, qreal *t1)
+{
+    /* |a + t (b - a) - p|^2 = r^2 */
+    qreal dx = bx - ax, dy = by - ay;
+    qreal fx = ax - px, fy = ay - py;
+    qreal a = dx * dx + dy * dy;
+    qreal b = 2 * (fx * dx + fy * dy);
+    qreal c = fx * fx + fy * fy - radius * radius;
+    if (a == 0) {
+        /* a point, either completely inside or outside */
+        if (c > 0)
+            return false;
+        *t0 = 0;
+        *t1 = 1;
+        return true;
+    }
+    qreal discriminant = b * b - 4 * a * c;
+    if (discriminant <= 0)
+        return false;
+    qreal root = std::sqrt(discriminant);
+    qreal s0 = (-b - root) / (2 * a);
+    qreal s1 = (-b + root) / (2 * a);
+    if (s1 <= 0 || s0 >= 1)
+        return false;
+    *t0 = qMax(s0, qreal(0));
+    *t1 = qMin(s1, qreal(1));
+    return *t0 < *t1;
+}
+
+/* Clips the parameter range [*t0, *t1] of a + t d to f0 + t f1 <= limit,
+ * returns false if it becomes empty. */
+static bool clipToHalfPlane(qreal f0, qreal f1, qreal limit, qreal *t0, qreal *t1)
+{
+    if (f1 == 0)
+        return f0 <= limit;
+    qreal t = (limit - f0) / f1;
+    if (f1 > 0)
+        *t1 = qMin(*t1, t);
+    else
+        *t0 = qMax(*t0, t);
+    return *t0 < *t1;
+}
+
+bool EraserKernel::clipSegmentToCapsule(qreal ax, qreal ay, qreal bx, qreal by,
+                                        qreal px, qreal py, qreal qx, qreal qy, qreal radius,
+                                        qreal *t0, qreal *t1)
+{
+    /* The capsule is the union of the circles around p and q and of the
+     * rectangle between them. It is convex, so the parts of the segment
+     * in these three shapes together form a single interval. */
+    bool found = false;
+    qreal s0, s1;
+    if (clipSegmentToCircle(ax, ay, bx, by, px, py, radius, &s0, &s1)) {
+        *t0 = s0;
+        *t1 = s1;
+        found = true;
+    }
+    qreal ux = qx - px, uy = qy - py;
+    qreal length = std::sqrt(ux * ux + uy * uy);
+    if (length == 0)
+        return found;
+    if (clipSegmentToCircle(ax, ay, bx, by, qx, qy, radius, &s0, &s1)) {
+        *t0 = found ? qMin(*t0, s0) : s0;
+        *t1 = found ? qMax(*t1, s1) : s1;
+        found = true;
+    }
+
+    /* rectangle: 0 <= (x - p).u <= length and |(x - p).v| <= radius with
+     * the unit vectors u along and v across the capsule */
+    ux /= length;
+    uy /= length;
+    qreal dx = bx - ax, dy = by - ay;
+    qreal fx = ax - px, fy = ay - py;
+    qreal along0 = fx * ux + fy * uy, along1 = dx * ux + dy * uy;
+    qreal across0 = fx * uy - fy * ux, across1 = dx * uy - dy * ux;
+    s0 = 0;
+    s1 = 1;
+    if (clipToHalfPlane(along0, along1, length, &s0, &s1) &&
+            clipToHalfPlane(-along0, -along1, 0, &s0, &s1) &&
+            clipToHalfPlane(across0, across1, radius, &s0, &s1) &&
+            clipToHalfPlane(-across0, -across1, radius, &s0, &s1)) {
+        *t0 = found ? qMin(*t0, s0) : s0;
+        *t1 = found ? qMax(*t1, s1) : s1;
+        found = true;
+    }
+    return found;
+}
@@ -0,0 +1,56 @@
+/*
+ * scribble: Scribbling Application for Onyx Boox M92
+ *
+ * Copyright (C) 2012 peter-x
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ERASER_KERNEL_H
+#define ERASER_KERNEL_H
+
+#include <QtGlobal>
+
+/* Distance tests of all segments of a polyline (given as separate x and
+ * y arrays of n points) at once, vectorized with SSE2 or NEON if the
+ * compiler supports it.
+ * For n >= 2, hit[i] is set to 1 for segment i (from point i to point
+ * i + 1) if it comes closer than radius, otherwise to 0. For n == 1 the
+ * single point is tested and the result is written to hit[0].
+ * The functions return the number of hits. */
+class EraserKernel
+{
+public:
+    /* segments near the point (px, py), i.e. intersecting the circle */
+    static int segmentsNearPoint(const float *x, const float *y, int n,
+                                 float px, float py, float radius, quint8 *hit);
+    /* segments near the segment from (ax, ay) to (bx, by), i.e.
+     * intersecting the capsule around it */
+    static int segmentsNearSegment(const float *x, const float *y, int n,
+                                   float ax, float ay, float bx, float by, float radius, quint8 *hit);
+
+    /* Computes the part [t0, t1] of the segment from (ax, ay) to (bx, by)
+     * (parametrized by 0 <= t <= 1) that lies within the circle. Returns
+     * false if that part is empty or a single point. */
+    static bool clipSegmentToCircle(qreal ax, qreal ay, qreal bx, qreal by,
+                                    qreal px, qreal py, qreal radius, qreal *t0, qreal *t1);
+    /* The same for the capsule of the given radius around the segment
+     * from (px, py) to (qx, qy). */
+    static bool clipSegmentToCapsule(qreal ax, qreal ay, qreal bx, qreal by,
+                                     qreal px, qreal py, qreal qx, qreal qy, qreal radius,
+                                     qreal *t0, qreal *t1);
+};
+
+#endif // ERASER_KERNEL_H
@@ -1,41 +1,312 @@
 #include "fileio.h"
 
-#include "filelocker.h"
-#include "zlib.h"
+#include <QtConcurrentRun>
+
+#include <climits>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
 
 QByteArray FileIO::readGZFileLocked(const QFile &file)
 {
     FileLocker locker(file);
 
-    gzFile f = gzopen(file.fileName().toLocal8Bit().constData(), "r");
-    if (f == 0)
+    QFile f(file.fileName());
+    if (!f.open(QIODevice::ReadOnly))
+        return QByteArray();
+    qint64 size = f.size();
+    if (size == 0 || size > INT_MAX)
+        return QByteArray();
+
+    /* the mapping is removed when f is closed */
+    const uchar *mapped = f.map(0, size);
+    if (mapped != 0)
+        return inflateGZ(mapped, int(size));
+    QByteArray compressed = f.readAll();
+    if (compressed.size() != size)
         return QByteArray();
+    return inflateGZ(reinterpret_cast<const uchar *>(compressed.constData()), compressed.size());
+}
+
+QByteArray FileIO::inflateGZ(const uchar *data, int size)
+{
+    if (size < 18 || data[0] != 0x1f || data[1] != 0x8b) {
+        /* not compressed, gzread also returns such files unchanged */
+        return QByteArray(reinterpret_cast<const char *>(data), size);
+    }
+
+    /* ISIZE, the last four bytes, is the uncompressed size modulo 2^32
+     * (of the last member only), so it is only used as a first guess */
+    quint32 isize = quint32(data[size - 4]) | (quint32(data[size - 3]) << 8) |
+            (quint32(data[size - 2]) << 16) | (quint32(data[size - 1]) << 24);
+    qint64 capacity = isize;
+    if (capacity < size || capacity > INT_MAX / 2)
+        capacity = qMin(qint64(size) * 4, qint64(INT_MAX / 2));
 
-    QByteArray data;
+    QByteArray output;
+    output.resize(int(capacity));
 
-    char buffer[1024];
-    while (!gzeof(f)) {
-        int len = gzread(f, buffer, 1024);
-        if (len < 0) {
-            gzclose(f);
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    /* 16: decode the gzip format */
+    if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK)
+        return QByteArray();
+    stream.next_in = const_cast<Bytef *>(data);
+    stream.avail_in = size;
+
+    int written = 0;
+    forever {
+        if (written == output.size()) {
+            if (output.size() >= INT_MAX / 2) {
+                inflateEnd(&stream);
+                return QByteArray();
+            }
+            output.resize(output.size() * 2);
+        }
+        stream.next_out = reinterpret_cast<Bytef *>(output.data()) + written;
+        stream.avail_out = output.size() - written;
+        /* usually inflates everything in one call */
+        int ret = inflate(&stream, Z_NO_FLUSH);
+        written = output.size() - stream.avail_out;
+        if (ret == Z_STREAM_END) {
+            /* concatenated gzip members are read like gzread does */
+            if (stream.avail_in >= 2 && stream.next_in[0] == 0x1f && stream.next_in[1] == 0x8b) {
+                inflateReset(&stream);
+                continue;
+            }
+            break;
+        } else if (ret == Z_BUF_ERROR && stream.avail_out == 0) {
+            continue;
+        } else if (ret != Z_OK) {
+            /* corrupt or truncated */
+            inflateEnd(&stream);
             return QByteArray();
         }
-        data.append(buffer, len);
     }
-    gzclose(f);
+    inflateEnd(&stream);
+
+    output.resize(written);
+    return output;
+}
+
+bool FileIO::writeGZFileLocked(const QFile &file, const QByteArray &data, int compressionLevel, int threads)
+{
+    GZFileWriter writer(file, compressionLevel, threads);
+    if (!writer.write(data)) {
+        writer.abort();
+        return false;
+    }
+    return writer.close();
+}
 
-    return data;
+QByteArray FileIO::readFileLocked(const QFile &file)
+{
+    FileLocker locker(file);
+
+    QFile f(file.fileName());
+    if (!f.open(QIODevice::ReadOnly))
+        return QByteArray();
+    return f.readAll();
+}
+
+bool FileIO::writeFileLocked(const QFile &file, const QByteArray &data)
+{
+    FileLocker locker(file);
+
+    QFile f(file.fileName());
+    if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+    bool ok = f.write(data) == data.size();
+    f.close();
+    return ok && f.error() == QFile::NoError;
 }
 
-bool FileIO::writeGZFileLocked(const QFile &file, const QByteArray &data)
+bool FileIO::appendFileLocked(const QFile &file, const QByteArray &data)
 {
     FileLocker locker(file);
 
-    gzFile f = gzopen(file.fileName().toLocal8Bit().constData(), "w");
-    if (f == 0) {
+    QFile f(file.fileName());
+    if (!f.open(QIODevice::WriteOnly | QIODevice::Append))
         return false;
+    bool ok = f.write(data) == data.size();
+    f.close();
+    return ok && f.error() == QFile::NoError;
+}
+
+bool FileIO::replaceFile(const QString &tempFileName, const QString &fileName)
+{
+    /* the data has to be on disk before the rename, otherwise a crash
+     * could leave an empty file behind */
+    int fd = ::open(QFile::encodeName(tempFileName).constData(), O_WRONLY);
+    if (fd < 0)
+        return false;
+    bool synced = ::fsync(fd) == 0;
+    ::close(fd);
+    /* QFile::rename does not overwrite, rename replaces the file atomically */
+    return synced && ::rename(QFile::encodeName(tempFileName).constData(),
+                              QFile::encodeName(fileName).constData()) == 0;
+}
+
+quint32 FileIO::checksum(const QByteArray &data)
+{
+    uLong crc = crc32(0L, Z_NULL, 0);
+    return crc32(crc, reinterpret_cast<const Bytef *>(data.constData()), data.size());
+}
+
+/* ---------------------------------------------------------------- */
+
+GZFileWriter::GZFileWriter(const QFile &file, int compressionLevel, int threads) :
+    locker(file), fileName(file.fileName()), tempFileName(file.fileName() + ".tmp"), closed(false),
+    f(0), ok(true), crc(crc32(0L, Z_NULL, 0)),
+    threads(threads), level(compressionLevel), rawFile(tempFileName), uncompressedSize(0)
+{
+    if (level < 0 || level > 9)
+        level = Z_DEFAULT_COMPRESSION;
+
+    if (threads <= 1) {
+        QByteArray mode("wb");
+        if (level != Z_DEFAULT_COMPRESSION)
+            mode += char('0' + level);
+        f = gzopen(QFile::encodeName(tempFileName).constData(), mode.constData());
+        if (f == 0)
+            ok = false;
+        return;
+    }
+
+    if (!rawFile.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        ok = false;
+        return;
+    }
+    /* magic, deflate, no flags, no time, no extra flags, OS unix */
+    static const char header[10] = {'\x1f', '\x8b', 8, 0, 0, 0, 0, 0, 0, 3};
+    if (rawFile.write(header, sizeof(header)) != sizeof(header))
+        ok = false;
+}
+
+GZFileWriter::~GZFileWriter()
+{
+    if (!closed)
+        abort();
+}
+
+bool GZFileWriter::write(const QByteArray &data)
+{
+    if (!ok || (f == 0 && !rawFile.isOpen()))
+        return false;
+    if (data.isEmpty())
+        return true;
+    crc = crc32(crc, reinterpret_cast<const Bytef *>(data.constData()), data.size());
+
+    if (f != 0) {
+        int written = gzwrite(f, data.constData(), data.size());
+        if (written != data.size())
+            ok = false;
+        return ok;
+    }
+
+    uncompressedSize += data.size();
+    pendingData += data;
+    if (pendingData.size() >= blockSize) {
+        int offset = 0;
+        for (; offset + blockSize <= pendingData.size(); offset += blockSize)
+            compressBlock(pendingData.mid(offset, blockSize));
+        pendingData.remove(0, offset);
+    }
+    return ok;
+}
+
+bool GZFileWriter::close()
+{
+    if (closed)
+        return ok;
+    closed = true;
+
+    if (f != 0) {
+        if (gzclose(f) != Z_OK)
+            ok = false;
+        f = 0;
     }
-    gzwrite(f, data.data(), data.size());
-    gzclose(f);
-    return true;
+    if (rawFile.isOpen()) {
+        if (!pendingData.isEmpty())
+            compressBlock(pendingData);
+        pendingData.clear();
+        while (!compressedBlocks.isEmpty())
+            writeCompressedBlock();
+
+        /* all blocks end with a sync flush, an empty final block ends
+         * the deflate stream, followed by CRC-32 and size (little endian) */
+        QByteArray trailer("\x03\x00", 2);
+        for (int i = 0; i < 4; i ++)
+            trailer += char((crc >> (8 * i)) & 0xff);
+        for (int i = 0; i < 4; i ++)
+            trailer += char((uncompressedSize >> (8 * i)) & 0xff);
+        if (ok && rawFile.write(trailer) != trailer.size())
+            ok = false;
+        rawFile.close();
+        if (rawFile.error() != QFile::NoError)
+            ok = false;
+    }
+    if (ok)
+        ok = FileIO::replaceFile(tempFileName, fileName);
+    if (!ok)
+        QFile::remove(tempFileName);
+    return ok;
+}
+
+void GZFileWriter::abort()
+{
+    /* close() does not commit, but waits for the blocks in flight */
+    ok = false;
+    close();
+}
+
+void GZFileWriter::compressBlock(const QByteArray &data)
+{
+    compressedBlocks.append(QtConcurrent::run(deflateBlock, data, dictionary, level));
+    dictionary = data.right(dictionarySize);
+    /* limits the memory used by blocks that wait to be written */
+    if (compressedBlocks.size() > 2 * threads)
+        writeCompressedBlock();
+}
+
+void GZFileWriter::writeCompressedBlock()
+{
+    QByteArray block = compressedBlocks.takeFirst().result();
+    if (!ok)
+        return;
+    if (block.isNull() || rawFile.write(block) != block.size())
+        ok = false;
+}
+
+QByteArray GZFileWriter::deflateBlock(const QByteArray &data, const QByteArray &dictionary, int level)
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    /* negative window bits: raw deflate data without header */
+    if (deflateInit2(&stream, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return QByteArray();
+    if (!dictionary.isEmpty() &&
+            deflateSetDictionary(&stream, reinterpret_cast<const Bytef *>(dictionary.constData()),
+                                 dictionary.size()) != Z_OK) {
+        deflateEnd(&stream);
+        return QByteArray();
+    }
+
+    QByteArray output;
+    /* the sync flush marker and block header are not part of the bound */
+    output.resize(deflateBound(&stream, data.size()) + 16);
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.constData()));
+    stream.avail_in = data.size();
+    stream.next_out = reinterpret_cast<Bytef *>(output.data());
+    stream.avail_out = output.size();
+    /* ends on a byte boundary, so the blocks can be concatenated */
+    int ret = deflate(&stream, Z_SYNC_FLUSH);
+    int produced = output.size() - stream.avail_out;
+    deflateEnd(&stream);
+    if (ret != Z_OK || stream.avail_in != 0 || stream.avail_out == 0)
+        return QByteArray();
+    output.resize(produced);
+    return output;
 }
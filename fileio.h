@@ -3,12 +3,95 @@
 
 #include <QByteArray>
 #include <QFile>
+#include <QFuture>
+#include <QList>
+
+#include "filelocker.h"
+#include "zlib.h"
 
 class FileIO
 {
 public:
+    /* The compressed file is mapped into memory and inflated in one go
+     * into a buffer of the size stored in the gzip trailer. Files that
+     * are not compressed are returned unchanged. */
     static QByteArray readGZFileLocked(const QFile &file);
-    static bool writeGZFileLocked(const QFile &file, const QByteArray &data);
+    /* compressionLevel is 0 to 9 or -1 for the zlib default, see
+     * GZFileWriter for threads */
+    static bool writeGZFileLocked(const QFile &file, const QByteArray &data, int compressionLevel = -1,
+                                  int threads = 1);
+
+    /* uncompressed access, e.g. for the journal */
+    static QByteArray readFileLocked(const QFile &file);
+    static bool writeFileLocked(const QFile &file, const QByteArray &data);
+    static bool appendFileLocked(const QFile &file, const QByteArray &data);
+
+    /* Flushes the completely written temporary file to disk and renames
+     * it to fileName, which is replaced atomically. The temporary file is
+     * left for the caller to remove if this fails. */
+    static bool replaceFile(const QString &tempFileName, const QString &fileName);
+
+    /* CRC-32 of the data */
+    static quint32 checksum(const QByteArray &data);
+
+private:
+    static QByteArray inflateGZ(const uchar *data, int size);
+};
+
+/* Writes a gzip file piece by piece, so the uncompressed data never has
+ * to be in memory completely. The file is locked while the writer
+ * exists. The data goes to a temporary file that replaces the file
+ * only once it is complete and on disk, so a crash or a failed write
+ * leaves the old file intact.
+ * With more than one thread, the data is cut into blocks that are
+ * compressed independently on the global thread pool (like pigz does,
+ * each block uses the end of the previous one as dictionary). The
+ * result is still a single standard gzip stream. */
+class GZFileWriter
+{
+public:
+    /* compressionLevel is 0 to 9 or -1 for the zlib default */
+    explicit GZFileWriter(const QFile &file, int compressionLevel = -1, int threads = 1);
+    ~GZFileWriter();
+
+    bool write(const QByteArray &data);
+    /* returns true if the file was opened, all data was written and the
+     * file was replaced */
+    bool close();
+    /* instead of close() if not all data could be written: the temporary
+     * file is removed and the file stays as it was, also done by the
+     * destructor if close() was not called */
+    void abort();
+
+    /* CRC-32 of the uncompressed data written so far */
+    quint32 checksum() const { return crc; }
+
+private:
+    static const int blockSize = 128 * 1024;
+    static const int dictionarySize = 32 * 1024;
+
+    void compressBlock(const QByteArray &data);
+    void writeCompressedBlock();
+    static QByteArray deflateBlock(const QByteArray &data, const QByteArray &dictionary, int level);
+
+    FileLocker locker;
+    QString fileName;
+    QString tempFileName;
+    bool closed;
+    gzFile f;
+    bool ok;
+    quint32 crc;
+
+    /* only used with more than one thread */
+    int threads;
+    int level;
+    QFile rawFile;
+    quint32 uncompressedSize;
+    QByteArray pendingData;
+    QByteArray dictionary;
+    QList<QFuture<QByteArray> > compressedBlocks;
+
+    Q_DISABLE_COPY(GZFileWriter)
 };
 
 #endif // FILEIO_H
@@ -22,6 +22,7 @@
 
 #include "filebrowser.h"
 #include "fileio.h"
+#include "scribble_journal.h"
 
 #include "onyx/screen/screen_proxy.h"
 #include "onyx/screen/screen_update_watcher.h"
@@ -31,12 +32,29 @@
 #include "onyx/ui/onyx_dialog.h"
 #include "onyx/ui/thumbnail_view.h"
 
+/* size of the journal at which the whole document is written again */
+static const qint64 maxJournalSize = 512 * 1024;
+/* milliseconds between two batches of touch samples */
+static const int touchFrameInterval = 20;
+
 MainWidget::MainWidget(QWidget *parent) :
-    QWidget(parent, Qt::FramelessWindowHint), touchActive(true), currentFile("")
+    QWidget(parent, Qt::FramelessWindowHint), touchActive(true),
+    compactionRunning(false), journalSize(0), journalIncomplete(false),
+    compressionLevel(-1), compressionThreads(1), simplificationTolerance(0), currentFile("")
 {
     document = new ScribbleDocument(this);
     scribbleArea = new ScribbleArea(this, document);
     pressure_of_last_point_ = 0;
+    touchSamplesPressure = 0;
+    touchSamplesTime = 0;
+    maxTouchLatency = 0;
+    touchStatisticsEnabled = false;
+    loggedTouchLatency = 0;
+    loggedDroppedSamples = 0;
+    lastTouchPressed = false;
+    touchFrameTimer.setInterval(touchFrameInterval);
+    touchFrameTimer.setSingleShot(true);
+    connect(&touchFrameTimer, SIGNAL(timeout()), SLOT(flushTouchSamples()));
 
     ui::OnyxToolBar *toolbar = new ui::OnyxToolBar(this);
     /* TODO use action groups */
@@ -56,6 +74,16 @@ MainWidget::MainWidget(QWidget *parent) :
     connect(eraser, SIGNAL(triggered()), document, SLOT(useEraser()));
     toolbar->addAction(eraser);
 
+    QAction *undo = new QAction(QIcon(":/images/undo.png"),
+                                "undo", this);
+    connect(undo, SIGNAL(triggered()), document, SLOT(undo()));
+    toolbar->addAction(undo);
+
+    QAction *redo = new QAction(QIcon(":/images/redo.png"),
+                                "redo", this);
+    connect(redo, SIGNAL(triggered()), document, SLOT(redo()));
+    toolbar->addAction(redo);
+
     /*
     QAction *thin = new QAction(QIcon(":images/sketch_shape_1.png"),
                                "thin", this);
@@ -94,7 +122,6 @@ MainWidget::MainWidget(QWidget *parent) :
     /* TODO need UI methods for:
      * layer access
      * loading and saving
-     * undo
      * set page and layer
      * remove page, insert page
      * set background
@@ -116,17 +143,34 @@ MainWidget::MainWidget(QWidget *parent) :
     setLayout(layout);
     onyx::screen::watcher().addWatcher(this);
 
+    QSettings settings("scribble", "scribble");
+    compressionLevel = settings.value("compressionLevel", -1).toInt();
+    compressionThreads = settings.value("compressionThreads", 1).toInt();
+    simplificationTolerance = settings.value("simplificationTolerance", 0.25).toDouble();
+    document->setSimplificationTolerance(simplificationTolerance);
+    /* bytes of strokes kept for undo */
+    document->setHistoryLimit(settings.value("undoMemory", 4 * 1024 * 1024).toInt());
+    touchStatisticsEnabled = settings.value("logTouchStatistics", false).toBool();
+
     asyncWriter = new AsyncWriter(this);
+    asyncWriter->setCompression(compressionLevel, compressionThreads);
+    connect(asyncWriter, SIGNAL(pageXmlComputed(int,int,QByteArray)),
+            document, SLOT(setPageXmlCache(int,int,QByteArray)));
+    connect(asyncWriter, SIGNAL(documentWritten(QString,bool,uint)),
+            SLOT(documentWritten(QString,bool,uint)));
 
     connect(document, SIGNAL(pageOrLayerNumberChanged(int,int,int,int)), SLOT(updateProgressBar(int,int,int,int)));
+    connect(document, SIGNAL(pagesDamaged(QList<int>)), SLOT(showDamagedPages(QList<int>)));
     connect(scribbleArea, SIGNAL(resized(QSize)), document, SLOT(setViewSize(QSize)));
     connect(statusBar, SIGNAL(progressClicked(int,int)), SLOT(setPage(int,int)));
 
-    connect(&touchListener, SIGNAL(touchData(TouchData &)), this, SLOT(touchEventDataReceived(TouchData &)));
+    touchInput = new TouchInputThread(this);
+    connect(touchInput, SIGNAL(samplesAvailable()), SLOT(takeTouchSamples()));
+    touchInput->start();
 
     QTimer *save_timer = new QTimer(this);
     connect(save_timer, SIGNAL(timeout()), SLOT(saveAsynchronously()));
-    /* save every 5 seconds */
+    /* save every 5 seconds (usually only appends to the journal) */
     save_timer->start(5000);
 }
 
@@ -136,15 +180,66 @@ void MainWidget::loadFile(const QFile &file)
 
     /* TODO error message */
     QByteArray data = FileIO::readGZFileLocked(file);
-    if (document->loadXournalFile(data)) {
+    QByteArray journal = FileIO::readFileLocked(QFile(ScribbleJournal::fileName(file.fileName())));
+    ScribbleDocument::JournalResult journalResult;
+    if (document->loadXournalFile(data, journal, &journalResult)) {
         currentFile.setFileName(file.fileName());
+        journalIncomplete = false;
+        /* pages are loaded lazily, find the broken ones now */
+        document->checkPages();
+        if (journalResult == ScribbleDocument::JOURNAL_APPLIED) {
+            journalSize = journal.size();
+            return;
+        }
+        /* never overwrite a journal we could not apply, it might still be
+         * recovered by hand */
+        if (!journal.isEmpty() && !moveJournalAside()) {
+            QMessageBox::warning(this, tr("Journal not applied"),
+                                 tr("The journal of this document could not be applied and not be "
+                                    "moved aside. Changes will not be saved."));
+            currentFile.setFileName(QString());
+            return;
+        }
+        if (journalResult == ScribbleDocument::JOURNAL_PARTLY_APPLIED) {
+            /* the applied records are only in memory now */
+            saveFile(currentFile);
+        } else {
+            journal = ScribbleJournal::header(FileIO::checksum(data));
+            journalIncomplete = !FileIO::writeFileLocked(QFile(journalFileName()), journal);
+            journalSize = journal.size();
+        }
     }
 }
 
 void MainWidget::saveFile(const QFile &file)
 {
-    FileIO::writeGZFileLocked(file, document->toXournalXMLFormat());
     currentFile.setFileName(file.fileName());
+    compactionRunning = false;
+    quint32 checksum;
+    if (document->writeXournalFile(file, compressionLevel, compressionThreads, &checksum)) {
+        /* everything is in the file now, start a new journal */
+        document->takeJournalRecords();
+        QByteArray journal = ScribbleJournal::header(checksum);
+        journalIncomplete = !FileIO::writeFileLocked(QFile(journalFileName()), journal);
+        journalSize = journal.size();
+    }
+}
+
+QString MainWidget::journalFileName() const
+{
+    return ScribbleJournal::fileName(currentFile.fileName());
+}
+
+bool MainWidget::moveJournalAside()
+{
+    QString name = journalFileName();
+    QString newName = name + "." + QDateTime::currentDateTime().toString("yyyyMMdd-hhmmss");
+    if (!QFile::rename(name, newName)) {
+        qWarning() << "Could not move journal aside:" << name;
+        return false;
+    }
+    qWarning() << "Moved journal that could not be applied to" << newName;
+    return true;
 }
 
 void MainWidget::keyPressEvent(QKeyEvent *event)
@@ -167,13 +262,70 @@ void MainWidget::keyPressEvent(QKeyEvent *event)
 }
 
 void MainWidget::touchEventDataReceived(const TouchData &data)
+{
+    const OnyxTouchPoint &touch_point = data.points[0];
+    addTouchSample(QPoint(touch_point.x, touch_point.y), touch_point.pressure, touchInput->now());
+}
+
+void MainWidget::takeTouchSamples()
+{
+    touchInput->startTaking();
+    TouchSample sample;
+    while (touchInput->takeSample(&sample))
+        addTouchSample(QPoint(sample.x, sample.y), sample.pressure, sample.time);
+}
+
+void MainWidget::addTouchSample(const QPoint &globalPos, int pressure, qint64 time)
 {
     if (!touchActive) return;
 
-    const OnyxTouchPoint &touch_point = data.points[0];
-    QPoint pos = scribbleArea->mapFromGlobal(QPoint(touch_point.x, touch_point.y));
+    QPoint pos = scribbleArea->mapFromGlobal(globalPos);
+    bool pressed = pressure > 0;
+
+    /* positions are whole pixels, a sample at the same pixel adds nothing */
+    if (pressed && lastTouchPressed && pos == lastTouchPos)
+        return;
+    lastTouchPos = pos;
+    lastTouchPressed = pressed;
+
+    if (!touchSamples.isEmpty() && (touchSamplesPressure > 0) != pressed)
+        flushTouchSamples();
+    if (touchSamples.isEmpty())
+        touchSamplesTime = time;
+    touchSamples.append(pos);
+    touchSamplesPressure = pressure;
+
+    if (!pressed) {
+        /* the end of a stroke is not delayed */
+        flushTouchSamples();
+    } else if (!touchFrameTimer.isActive()) {
+        touchFrameTimer.start();
+    }
+}
 
-    document->touchEventDataReceived(pos, data.points[0].pressure);
+void MainWidget::flushTouchSamples()
+{
+    touchFrameTimer.stop();
+    if (touchSamples.isEmpty())
+        return;
+    QPolygon samples = touchSamples;
+    touchSamples.clear();
+    document->touchEventDataReceived(samples, touchSamplesPressure);
+    /* the samples are drawn now */
+    maxTouchLatency = qMax(maxTouchLatency, touchInput->now() - touchSamplesTime);
+}
+
+void MainWidget::logTouchStatistics()
+{
+    if (!touchStatisticsEnabled)
+        return;
+    const TouchSampleQueue &queue = touchInput->getQueue();
+    if (maxTouchLatency == loggedTouchLatency && queue.droppedSamples() == loggedDroppedSamples)
+        return;
+    loggedTouchLatency = maxTouchLatency;
+    loggedDroppedSamples = queue.droppedSamples();
+    qDebug() << "Touch input: max latency" << maxTouchLatency << "ms, max queue depth"
+             << queue.maxDepthSeen() << ", dropped samples" << queue.droppedSamples();
 }
 
 void MainWidget::mousePressEvent(QMouseEvent *ev)
@@ -205,6 +357,7 @@ void MainWidget::mouseReleaseEvent(QMouseEvent *ev)
 
 void MainWidget::open()
 {
+    flushTouchSamples();
     touchActive = false;
 
     FileBrowser fileBrowser(this);
@@ -222,6 +375,7 @@ void MainWidget::open()
 void MainWidget::save()
 {
     if (!currentFile.fileName().isEmpty()) {
+        flushTouchSamples();
         asyncWriter->stopWriting();
         /* save timeout cannot occur now since this is the same thread */
         saveFile(currentFile);
@@ -244,6 +398,16 @@ void MainWidget::updateProgressBar(int currentPage, int maxPages, int currentLay
     statusBar->setProgress(currentPage + 1, maxPages);
 }
 
+void MainWidget::showDamagedPages(const QList<int> &pages)
+{
+    QStringList numbers;
+    foreach (int page, pages)
+        numbers.append(QString::number(page + 1));
+    QMessageBox::warning(this, "Damaged pages",
+                         "These pages could not be read and cannot be changed, "
+                         "they are kept unchanged in the file: " + numbers.join(", "));
+}
+
 void MainWidget::setPage(int percentage, int page)
 {
     document->setCurrentPage(page - 1);
@@ -251,8 +415,50 @@ void MainWidget::setPage(int percentage, int page)
 
 void MainWidget::saveAsynchronously()
 {
-    if (!currentFile.fileName().isEmpty() && document->hasChangedSinceLastSave()) {
-        document->setSaved();
-        asyncWriter->writeData(document->getPagesCopy(), currentFile);
+    /* changes are collected in the document until the compaction is finished */
+    if (currentFile.fileName().isEmpty() || compactionRunning ||
+            !(document->hasChangedSinceLastSave() || journalIncomplete))
+        return;
+    document->setSaved();
+
+    if (!journalIncomplete) {
+        /* the records stay in the document until they are in the journal */
+        const QByteArray &records = document->getJournalRecords();
+        if (FileIO::appendFileLocked(QFile(journalFileName()), records)) {
+            journalSize += records.size();
+            document->takeJournalRecords();
+            if (journalSize <= maxJournalSize)
+                return;
+        } else {
+            /* records after the gap would be replayed against the wrong
+             * strokes, do not append anymore */
+            journalIncomplete = true;
+        }
+    }
+
+    /* the journal got too large (or could not be written): write the
+     * complete document in the background and start a new journal
+     * once that is done, the records so far are part of the copy */
+    compactionRunning = true;
+    asyncWriter->writeData(document->getPagesCopy(), currentFile);
+    document->takeJournalRecords();
+}
+
+void MainWidget::documentWritten(const QString &fileName, bool success, uint checksum)
+{
+    /* the UI thread can be slowed down during a save, see how input kept up */
+    logTouchStatistics();
+    if (!compactionRunning || fileName != currentFile.fileName())
+        return;
+    compactionRunning = false;
+    if (!success) {
+        /* the old journal is still valid unless changes are missing in
+         * it, then try once more without a thread */
+        if (journalIncomplete)
+            saveFile(currentFile);
+        return;
     }
+    QByteArray journal = ScribbleJournal::header(checksum) + document->takeJournalRecords();
+    journalIncomplete = !FileIO::writeFileLocked(QFile(journalFileName()), journal);
+    journalSize = journal.size();
 }
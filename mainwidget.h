@@ -24,11 +24,11 @@
 #include <QtGui>
 
 #include <onyx/ui/status_bar.h>
-#include <onyx/touch/touch_listener.h>
 
 #include "asyncwriter.h"
 #include "scribblearea.h"
 #include "scribble_document.h"
+#include "touch_input.h"
 
 class MainWidget : public QWidget
 {
@@ -46,15 +46,21 @@ public slots:
 
 private slots:
     void touchEventDataReceived(const TouchData &);
+    /* takes the samples queued by touchInput */
+    void takeTouchSamples();
+    /* passes the collected touch samples to the document */
+    void flushTouchSamples();
     void mousePressEvent(QMouseEvent *ev);
     void mouseMoveEvent(QMouseEvent *ev);
     void mouseReleaseEvent(QMouseEvent *ev);
 
     void save();
     void saveAs();
+    void documentWritten(const QString &fileName, bool success, uint checksum);
     void open();
 
     void updateProgressBar(int currentPage, int maxPages, int currentLayer, int maxLayers);
+    void showDamagedPages(const QList<int> &pages);
     void setPage(int percentage, int page);
 
 
@@ -62,12 +68,53 @@ protected:
     void keyPressEvent(QKeyEvent *);
 
 private:
-    TouchEventListener touchListener;
+    TouchInputThread *touchInput;
     int pressure_of_last_point_;
 
+    /* pos in global coordinates, time as in TouchInputThread::now() */
+    void addTouchSample(const QPoint &pos, int pressure, qint64 time);
+    /* logs the touch input counters if they changed */
+    void logTouchStatistics();
+
+    /* Touch samples are collected and passed to the document once per
+     * frame. All of them are either pressed or lifted. */
+    QPolygon touchSamples;
+    int touchSamplesPressure;
+    /* when the first of touchSamples was received */
+    qint64 touchSamplesTime;
+    /* the longest time from receiving a sample until it was drawn */
+    qint64 maxTouchLatency;
+    /* prints the latency and queue statistics, off by default */
+    bool touchStatisticsEnabled;
+    qint64 loggedTouchLatency;
+    int loggedDroppedSamples;
+    QTimer touchFrameTimer;
+    /* the last sample that was collected, to drop repeated ones */
+    QPoint lastTouchPos;
+    bool lastTouchPressed;
+
     bool touchActive;
 
+    QString journalFileName() const;
+    bool moveJournalAside();
+
     AsyncWriter *asyncWriter;
+    /* a complete write of the document is running in asyncWriter,
+     * the journal is restarted once it is finished */
+    bool compactionRunning;
+    qint64 journalSize;
+    /* changes are missing in the journal, only writing the whole
+     * document helps */
+    bool journalIncomplete;
+    /* zlib compression level of the document file, "compressionLevel" in
+     * the settings, -1 for the zlib default */
+    int compressionLevel;
+    /* "compressionThreads" in the settings, more than one compresses
+     * blocks in parallel (see GZFileWriter) */
+    int compressionThreads;
+    /* "simplificationTolerance" in the settings, see
+     * ScribbleDocument::setSimplificationTolerance */
+    qreal simplificationTolerance;
     QFile currentFile;
     ScribbleArea *scribbleArea;
     ScribbleDocument *document;
@@ -0,0 +1,336 @@
+/*
+ * scribble: Scribbling Application for Onyx Boox M92
+ *
+ * Copyright (C) 2012 peter-x
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "native_format.h"
+
+#include <QtEndian>
+#include <QColor>
+#include <QDebug>
+#include <QPair>
+#include <QPen>
+#include <QVector>
+
+#include <cstring>
+
+static const char nativeMagic[8] = {'S', 'C', 'R', 'I', 'B', 'B', 'L', 'E'};
+
+static int padding(int size, int alignment)
+{
+    return (alignment - size % alignment) % alignment;
+}
+
+static void appendUInt32(QByteArray &data, quint32 value)
+{
+    uchar bytes[4];
+    qToLittleEndian(value, bytes);
+    data.append(reinterpret_cast<const char *>(bytes), 4);
+}
+
+static void appendUInt64(QByteArray &data, quint64 value)
+{
+    uchar bytes[8];
+    qToLittleEndian(value, bytes);
+    data.append(reinterpret_cast<const char *>(bytes), 8);
+}
+
+static void appendFloat(QByteArray &data, float value)
+{
+    quint32 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    appendUInt32(data, bits);
+}
+
+static void appendDouble(QByteArray &data, double value)
+{
+    quint64 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    appendUInt64(data, bits);
+}
+
+static void appendFloats(QByteArray &data, const float *values, int n)
+{
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    data.append(reinterpret_cast<const char *>(values), n * sizeof(float));
+#else
+    for (int i = 0; i < n; i ++)
+        appendFloat(data, values[i]);
+#endif
+}
+
+/* size (-1 for the null string) and UTF-8, padded to four bytes */
+static void appendString(QByteArray &data, const QString &str)
+{
+    if (str.isNull()) {
+        appendUInt32(data, quint32(-1));
+        return;
+    }
+    QByteArray utf8 = str.toUtf8();
+    appendUInt32(data, utf8.size());
+    data.append(utf8);
+    data.append(QByteArray(padding(utf8.size(), 4), '\0'));
+}
+
+/* reads from a block, all reads fail once one of them went past the end */
+class NativeReader
+{
+public:
+    NativeReader(const QByteArray &data) :
+        pos(reinterpret_cast<const uchar *>(data.constData())), end(pos + data.size()), ok(true) {}
+
+    bool isOk() const { return ok; }
+    const uchar *position() const { return pos; }
+
+    bool skip(qint64 size) {
+        if (!ok || size < 0 || size > end - pos)
+            ok = false;
+        else
+            pos += size;
+        return ok;
+    }
+    quint32 readUInt32() {
+        const uchar *p = pos;
+        if (!skip(4))
+            return 0;
+        return qFromLittleEndian<quint32>(p);
+    }
+    quint64 readUInt64() {
+        const uchar *p = pos;
+        if (!skip(8))
+            return 0;
+        return qFromLittleEndian<quint64>(p);
+    }
+    float readFloat() {
+        quint32 bits = readUInt32();
+        float value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+    double readDouble() {
+        quint64 bits = readUInt64();
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+    bool readFloats(float *values, int n) {
+        const uchar *p = pos;
+        if (!skip(qint64(n) * sizeof(float)))
+            return false;
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+        memcpy(values, p, n * sizeof(float));
+#else
+        for (int i = 0; i < n; i ++) {
+            quint32 bits = qFromLittleEndian<quint32>(p + 4 * i);
+            memcpy(values + i, &bits, sizeof(float));
+        }
+#endif
+        return true;
+    }
+    QString readString() {
+        quint32 size = readUInt32();
+        if (size == quint32(-1) || !ok)
+            return QString();
+        const uchar *p = pos;
+        if (!skip(qint64(size) + padding(size % 4, 4)))
+            return QString();
+        return QString::fromUtf8(reinterpret_cast<const char *>(p), size);
+    }
+
+private:
+    const uchar *pos;
+    const uchar *end;
+    bool ok;
+};
+
+bool NativeFormat::isNativeFormat(const QByteArray &data)
+{
+    return data.size() >= headerSize && memcmp(data.constData(), nativeMagic, sizeof(nativeMagic)) == 0;
+}
+
+bool NativeFormat::read(const QByteArray &data, const QSharedPointer<QFile> &file, QString *title,
+                        QList<ScribblePage> *pages)
+{
+    if (!isNativeFormat(data))
+        return false;
+    NativeReader reader(data);
+    reader.skip(sizeof(nativeMagic));
+    quint32 fileVersion = reader.readUInt32();
+    if (fileVersion != version) {
+        qWarning() << "Unsupported version of the native format:" << fileVersion;
+        return false;
+    }
+    quint32 numPages = reader.readUInt32();
+    quint32 titleSize = reader.readUInt32();
+    reader.readUInt32();
+    const uchar *titleData = reader.position();
+    if (!reader.skip(qint64(titleSize) + padding(titleSize % 8, 8)))
+        return false;
+    QString parsedTitle = QString::fromUtf8(reinterpret_cast<const char *>(titleData), titleSize);
+
+    QList<ScribblePage> parsedPages;
+    for (quint32 i = 0; i < numPages && reader.isOk(); i ++) {
+        ScribblePage page;
+        page.size.setWidth(reader.readDouble());
+        page.size.setHeight(reader.readDouble());
+        quint64 offset = reader.readUInt64();
+        quint64 size = reader.readUInt64();
+        if (!reader.isOk() || offset > quint64(data.size()) || size > quint64(data.size()) - offset)
+            return false;
+        if (file.isNull())
+            page.setUnloadedNative(data.mid(offset, size), file);
+        else /* refers to the page in the mapping, nothing is copied */
+            page.setUnloadedNative(QByteArray::fromRawData(data.constData() + offset, size), file);
+        parsedPages.append(page);
+    }
+    if (!reader.isOk())
+        return false;
+
+    *title = parsedTitle;
+    *pages = parsedPages;
+    return true;
+}
+
+bool NativeFormat::write(const QString &title, const QList<ScribblePage> &pages, QByteArray *output)
+{
+    QList<QByteArray> blocks;
+    for (int i = 0; i < pages.length(); i ++) {
+        const ScribblePage &page = pages[i];
+        if (page.hasNativeBlock()) {
+            blocks.append(page.getNativeBlock());
+        } else if (page.isDamaged()) {
+            /* only its XML is known */
+            return false;
+        } else if (!page.isLoaded()) {
+            /* e.g. a lazily loaded Xournal page, only the copy is loaded */
+            ScribblePage copy = page;
+            if (!copy.ensureLoaded())
+                return false;
+            blocks.append(pageBlock(copy));
+        } else {
+            blocks.append(pageBlock(page));
+        }
+    }
+
+    QByteArray titleData = title.toUtf8();
+    qint64 offset = headerSize + titleData.size() + padding(titleData.size(), 8) +
+            qint64(pageEntrySize) * pages.length();
+    qint64 totalSize = offset;
+    for (int i = 0; i < blocks.length(); i ++)
+        totalSize += blocks[i].size();
+
+    QByteArray data;
+    data.reserve(totalSize);
+    data.append(nativeMagic, sizeof(nativeMagic));
+    appendUInt32(data, version);
+    appendUInt32(data, pages.length());
+    appendUInt32(data, titleData.size());
+    appendUInt32(data, 0);
+    data.append(titleData);
+    data.append(QByteArray(padding(titleData.size(), 8), '\0'));
+    for (int i = 0; i < pages.length(); i ++) {
+        appendDouble(data, pages[i].size.width());
+        appendDouble(data, pages[i].size.height());
+        appendUInt64(data, offset);
+        appendUInt64(data, blocks[i].size());
+        offset += blocks[i].size();
+    }
+    for (int i = 0; i < blocks.length(); i ++)
+        data.append(blocks[i]);
+    *output = data;
+    return true;
+}
+
+bool NativeFormat::readPage(const QByteArray &block, ScribblePage *page)
+{
+    NativeReader reader(block);
+    quint32 numLayers = reader.readUInt32();
+    ScribbleXournalBackground background;
+    background.type = reader.readString();
+    background.color = reader.readString();
+    background.style = reader.readString();
+    background.domain = reader.readString();
+    background.filename = reader.readString();
+    background.pageno = reader.readString();
+
+    QList<ScribbleLayer> layers;
+    /* the pens of the page, usually only a few different ones */
+    QList<QPair<QPair<quint32, float>, QPen> > pens;
+    for (quint32 li = 0; li < numLayers && reader.isOk(); li ++) {
+        ScribbleLayer layer;
+        quint32 numStrokes = reader.readUInt32();
+        for (quint32 si = 0; si < numStrokes && reader.isOk(); si ++) {
+            QPair<quint32, float> penKey;
+            penKey.first = reader.readUInt32();
+            penKey.second = reader.readFloat();
+            quint32 numPoints = reader.readUInt32();
+            /* checked before the allocation */
+            if (!reader.isOk() || numPoints > quint32(block.size()) / (2 * sizeof(float)))
+                return false;
+
+            int pen = 0;
+            while (pen < pens.length() && pens[pen].first != penKey)
+                pen ++;
+            if (pen == pens.length()) {
+                QPen p;
+                p.setColor(QColor::fromRgba(penKey.first));
+                p.setWidthF(penKey.second);
+                pens.append(qMakePair(penKey, p));
+            }
+
+            QVector<float> xs(numPoints), ys(numPoints);
+            reader.readFloats(xs.data(), numPoints);
+            reader.readFloats(ys.data(), numPoints);
+            ScribbleStroke stroke;
+            stroke.setPen(pens[pen].second);
+            stroke.setPoints(xs, ys);
+            layer.appendStroke(stroke);
+        }
+        layers.append(layer);
+    }
+    if (!reader.isOk() || layers.isEmpty())
+        return false;
+
+    page->layers = layers;
+    page->background = background;
+    return true;
+}
+
+QByteArray NativeFormat::pageBlock(const ScribblePage &page)
+{
+    QByteArray data;
+    appendUInt32(data, page.layers.length());
+    appendString(data, page.background.type);
+    appendString(data, page.background.color);
+    appendString(data, page.background.style);
+    appendString(data, page.background.domain);
+    appendString(data, page.background.filename);
+    appendString(data, page.background.pageno);
+    foreach (const ScribbleLayer &layer, page.layers) {
+        appendUInt32(data, layer.getNumStrokes());
+        foreach (const ScribbleStroke &stroke, layer.getStrokes()) {
+            QPen pen = stroke.getPen();
+            appendUInt32(data, pen.color().rgba());
+            appendFloat(data, pen.widthF());
+            appendUInt32(data, stroke.getNumPoints());
+            appendFloats(data, stroke.getXData(), stroke.getNumPoints());
+            appendFloats(data, stroke.getYData(), stroke.getNumPoints());
+        }
+    }
+    return data;
+}
@@ -0,0 +1,75 @@
+/*
+ * scribble: Scribbling Application for Onyx Boox M92
+ *
+ * Copyright (C) 2012 peter-x
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef NATIVE_FORMAT_H
+#define NATIVE_FORMAT_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QList>
+#include <QSharedPointer>
+#include <QString>
+
+#include "scribble_document.h"
+
+/* Binary document format that can be read without parsing text. All
+ * numbers are little endian, all blocks are aligned to four bytes, so
+ * the points can be copied directly out of a mapped file.
+ *
+ *   header      "SCRIBBLE", version, number of pages, title size, 0
+ *   title       UTF-8, padded to eight bytes
+ *   page table  per page: width and height (double), offset and size
+ *               of the page block (quint64)
+ *   page block  number of layers, the six background attributes
+ *               (size or -1 for null, then UTF-8), then per layer the
+ *               number of strokes and per stroke the color (ARGB),
+ *               pen width (float), number of points n, followed by n
+ *               x and n y coordinates (float)
+ *
+ * Pages are only located when the file is read and stay unloaded
+ * until they are needed (see ScribblePage::setUnloadedNative). */
+class NativeFormat
+{
+public:
+    static const quint32 version = 1;
+
+    static bool isNativeFormat(const QByteArray &data);
+
+    /* If file is given, data is a mapping of it and the pages refer to
+     * their blocks in it (and keep the file open), otherwise the blocks
+     * are copied. Returns false for other versions and damaged files. */
+    static bool read(const QByteArray &data, const QSharedPointer<QFile> &file, QString *title,
+                     QList<ScribblePage> *pages);
+    /* Unloaded pages of a native file are copied without loading them,
+     * other unloaded pages are loaded first. Fails (instead of writing
+     * an empty page) if one of them cannot be loaded. */
+    static bool write(const QString &title, const QList<ScribblePage> &pages, QByteArray *output);
+
+    /* reads the layers and background of the page from its block */
+    static bool readPage(const QByteArray &block, ScribblePage *page);
+    static QByteArray pageBlock(const ScribblePage &page);
+
+private:
+    static const int headerSize = 24;
+    static const int pageEntrySize = 32;
+    static const int strokeHeaderSize = 12;
+};
+
+#endif // NATIVE_FORMAT_H
@@ -23,36 +23,545 @@
 #include <QtXml/QtXml>
 #include <QHash>
 #include <QColor>
-
+#include <QAtomicInt>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QtConcurrentMap>
+#include <QtConcurrentRun>
+#include <QThreadPool>
+#include <QTimer>
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+#include "coordinate_codec.h"
+#include "eraser_kernel.h"
 #include "fileio.h"
+#include "native_format.h"
+#include "scribble_history.h"
+#include "scribble_journal.h"
+#include "xournal_parser.h"
+
+/* The pens are kept in chunks that are allocated once and never freed,
+ * so the entries stay where they are while the table grows. count is
+ * only increased after a new entry is complete. */
+class ScribblePenTableData
+{
+public:
+    static const int chunkSize = 256;
+    static const int maxPens = 0x10000;
+
+    ScribblePenTableData() : count(0) {
+        memset(chunks, 0, sizeof(chunks));
+        /* index 0 is the default pen */
+        append(QPen());
+    }
 
-bool ScribbleStroke::segmentIntersects(int i, const ScribbleStroke &o) const
+    static ScribblePenTableData &instance() {
+        static ScribblePenTableData data;
+        return data;
+    }
+
+    const QPen &at(int index) const {
+        return chunks[index / chunkSize][index % chunkSize];
+    }
+    /* number of complete entries, can be called without the mutex */
+    int size() {
+        return count.fetchAndAddAcquire(0);
+    }
+    /* the mutex has to be held */
+    void append(const QPen &pen) {
+        int index = count;
+        if (chunks[index / chunkSize] == 0)
+            chunks[index / chunkSize] = new QPen[chunkSize];
+        chunks[index / chunkSize][index % chunkSize] = pen;
+        count.fetchAndAddRelease(1);
+    }
+
+    QMutex mutex;
+
+private:
+    QPen *chunks[maxPens / chunkSize];
+    QAtomicInt count;
+};
+
+quint16 ScribblePenTable::indexOf(const QPen &pen)
 {
-    if (i < 0 || i + 1 >= points.size()) return false;
+    ScribblePenTableData &data = ScribblePenTableData::instance();
+    int size = data.size();
+    for (int i = 0; i < size; i ++) {
+        if (data.at(i) == pen)
+            return i;
+    }
 
-    QPointF p1(points[i]);
-    QPointF p2(points[i + 1]);
+    QMutexLocker locker(&data.mutex);
+    /* another thread could have added it in the meantime */
+    for (int i = size; i < data.size(); i ++) {
+        if (data.at(i) == pen)
+            return i;
+    }
+    if (data.size() >= ScribblePenTableData::maxPens) {
+        qWarning() << "Too many different pens, using the default pen.";
+        return 0;
+    }
+    data.append(pen);
+    return data.size() - 1;
+}
 
-    /* TODO
-     * first check if the bounding box of this segment (plus width!) intersects the stroke
-     * then check for each segment of the stroke if they intersect */
-    return true;
+const QPen &ScribblePenTable::pen(quint16 index)
+{
+    return ScribblePenTableData::instance().at(index);
+}
+
+/* ---------------------------------------------------------------- */
+
+ScribbleStroke::ScribbleStroke(const QPen &pen, const QPolygonF &points)
+{
+    setPen(pen);
+    resetBounds();
+    appendPoints(points);
+}
+
+ScribbleStroke::ScribbleStroke(const ScribbleStroke &o, int from, int count) :
+    penIndex(o.penIndex)
+{
+    resetBounds();
+    appendPoints(o.xs.constData() + from, o.ys.constData() + from, count);
 }
 
-void ScribbleStroke::updateBoundingRect()
+QPolygonF ScribbleStroke::getPoints() const
 {
-    boundingRect = points.boundingRect();
-    qreal a = pen.widthF() / 2.0;
+    QPolygonF points(xs.size());
+    for (int i = 0; i < xs.size(); i ++)
+        points[i] = QPointF(xs[i], ys[i]);
+    return points;
+}
+
+bool ScribbleStroke::segmentIntersects(int i, const ScribbleStroke &o) const
+{
+    if (i < 0 || i + 1 >= getNumPoints() || o.getNumPoints() == 0) return false;
+
+    /* the ink of the two strokes touches */
+    qreal radius = (getPenWidth() + o.getPenWidth()) / 2.0;
+    QRectF segmentRect = QRectF(getPoint(i), getPoint(i + 1)).normalized()
+            .adjusted(-radius, -radius, radius, radius);
+    /* not QRectF::intersects(), the points of o can have an empty bounding rect */
+    if (o.maxX < segmentRect.left() || o.minX > segmentRect.right() ||
+            o.maxY < segmentRect.top() || o.minY > segmentRect.bottom())
+        return false;
+
+    QVector<quint8> hits(o.getNumPoints());
+    return EraserKernel::segmentsNearSegment(o.getXData(), o.getYData(), o.getNumPoints(),
+                                             xs[i], ys[i], xs[i + 1], ys[i + 1], radius, hits.data()) > 0;
+}
+
+QRectF ScribbleStroke::getBoundingRect() const
+{
+    QRectF boundingRect;
+    if (!xs.isEmpty())
+        boundingRect = QRectF(QPointF(minX, minY), QPointF(maxX, maxY));
+    qreal a = getPenWidth() / 2.0;
     a = qMin(a, qreal(0.6));
     /* bounding rect with zero width or height produces not the intended result */
-    boundingRect.adjust(-a, -a, a, a);
+    return boundingRect.adjusted(-a, -a, a, a);
+}
+
+void ScribbleStroke::appendPoint(const QPointF &p)
+{
+    xs.append(p.x());
+    ys.append(p.y());
+    extendBounds(xs.last(), ys.last());
+}
+
+void ScribbleStroke::appendPoints(const QVector<QPointF> &p)
+{
+    xs.reserve(xs.size() + p.size());
+    ys.reserve(ys.size() + p.size());
+    foreach (const QPointF &point, p)
+        appendPoint(point);
+}
+
+void ScribbleStroke::appendPoints(const float *x, const float *y, int n)
+{
+    if (n <= 0) return;
+    int oldSize = xs.size();
+    xs.resize(oldSize + n);
+    ys.resize(oldSize + n);
+    memcpy(xs.data() + oldSize, x, n * sizeof(float));
+    memcpy(ys.data() + oldSize, y, n * sizeof(float));
+    for (int i = 0; i < n; i ++)
+        extendBounds(x[i], y[i]);
+}
+
+void ScribbleStroke::setPoints(const QVector<float> &x, const QVector<float> &y)
+{
+    Q_ASSERT(x.size() == y.size());
+    xs = x;
+    ys = y;
+    resetBounds();
+    for (int i = 0; i < xs.size(); i ++)
+        extendBounds(xs[i], ys[i]);
+}
+
+bool ScribbleStroke::simplify(qreal tolerance)
+{
+    int n = xs.size();
+    if (n <= 2)
+        return false;
+
+    /* without recursion, long strokes would need a deep stack */
+    QVector<bool> keep(n, false);
+    keep[0] = keep[n - 1] = true;
+    QVector<QPair<int, int> > ranges;
+    ranges.append(qMakePair(0, n - 1));
+    qreal maxDistance = tolerance * tolerance;
+    while (!ranges.isEmpty()) {
+        int a = ranges.last().first;
+        int b = ranges.last().second;
+        ranges.remove(ranges.size() - 1);
+
+        /* the distance to the segment and not to the line, points
+         * beyond the ends (e.g. where the pen turns) are kept */
+        qreal dx = xs[b] - xs[a], dy = ys[b] - ys[a];
+        qreal length = dx * dx + dy * dy;
+        qreal farthest = -1;
+        int farthestIndex = -1;
+        for (int i = a + 1; i < b; i ++) {
+            qreal px = xs[i] - xs[a], py = ys[i] - ys[a];
+            qreal t = length > 0 ? qBound(qreal(0), (px * dx + py * dy) / length, qreal(1)) : 0;
+            qreal ex = px - t * dx, ey = py - t * dy;
+            qreal d = ex * ex + ey * ey;
+            if (d > farthest) {
+                farthest = d;
+                farthestIndex = i;
+            }
+        }
+        if (farthest > maxDistance) {
+            keep[farthestIndex] = true;
+            ranges.append(qMakePair(a, farthestIndex));
+            ranges.append(qMakePair(farthestIndex, b));
+        }
+    }
+
+    QVector<float> x, y;
+    for (int i = 0; i < n; i ++) {
+        if (keep[i]) {
+            x.append(xs[i]);
+            y.append(ys[i]);
+        }
+    }
+    if (x.size() == n)
+        return false;
+    setPoints(x, y);
+    return true;
+}
+
+void ScribbleStroke::resetBounds()
+{
+    minX = minY = std::numeric_limits<float>::max();
+    maxX = maxY = -std::numeric_limits<float>::max();
+}
+
+void ScribbleStroke::extendBounds(float x, float y)
+{
+    minX = qMin(minX, x);
+    maxX = qMax(maxX, x);
+    minY = qMin(minY, y);
+    maxY = qMax(maxY, y);
+}
+
+/* ---------------------------------------------------------------- */
+
+void ScribbleStrokeIndex::insert(int stroke, const QRectF &rect)
+{
+    if (rect.isNull()) return;
+
+    QRect range = cellRange(rect);
+    if (isLarge(range)) {
+        insertSorted(largeStrokes, stroke);
+        return;
+    }
+    for (int y = range.top(); y <= range.bottom(); y ++) {
+        for (int x = range.left(); x <= range.right(); x ++) {
+            insertSorted(cells[cellKey(x, y)], stroke);
+        }
+    }
+}
+
+void ScribbleStrokeIndex::extend(int stroke, const QRectF &oldRect, const QRectF &newRect)
+{
+    if (oldRect.isNull()) {
+        insert(stroke, newRect);
+        return;
+    }
+
+    QRect oldRange = cellRange(oldRect);
+    QRect newRange = cellRange(newRect);
+    if (isLarge(oldRange)) {
+        /* rects only grow, so it stays large */
+        return;
+    }
+    if (isLarge(newRange)) {
+        remove(stroke, oldRect);
+        insertSorted(largeStrokes, stroke);
+        return;
+    }
+    for (int y = newRange.top(); y <= newRange.bottom(); y ++) {
+        for (int x = newRange.left(); x <= newRange.right(); x ++) {
+            if (!oldRange.contains(x, y))
+                insertSorted(cells[cellKey(x, y)], stroke);
+        }
+    }
+}
+
+void ScribbleStrokeIndex::remove(int stroke, const QRectF &rect)
+{
+    if (rect.isNull()) return;
+
+    QRect range = cellRange(rect);
+    if (isLarge(range)) {
+        removeSorted(largeStrokes, stroke);
+        return;
+    }
+    for (int y = range.top(); y <= range.bottom(); y ++) {
+        for (int x = range.left(); x <= range.right(); x ++) {
+            QHash<quint32, QVector<int> >::iterator it = cells.find(cellKey(x, y));
+            if (it == cells.end())
+                continue;
+            removeSorted(it.value(), stroke);
+            if (it.value().isEmpty())
+                cells.erase(it);
+        }
+    }
+}
+
+QVector<int> ScribbleStrokeIndex::query(const QRectF &rect) const
+{
+    QVector<int> result = largeStrokes;
+
+    QRect range = cellRange(rect);
+    if (qint64(range.width()) * range.height() > cells.size()) {
+        /* cheaper to look at all cells */
+        for (QHash<quint32, QVector<int> >::const_iterator it = cells.constBegin(); it != cells.constEnd(); ++ it) {
+            int x = qint16(it.key() >> 16);
+            int y = qint16(it.key() & 0xffff);
+            if (range.contains(x, y))
+                result += it.value();
+        }
+    } else {
+        for (int y = range.top(); y <= range.bottom(); y ++) {
+            for (int x = range.left(); x <= range.right(); x ++) {
+                QHash<quint32, QVector<int> >::const_iterator it = cells.constFind(cellKey(x, y));
+                if (it != cells.constEnd())
+                    result += it.value();
+            }
+        }
+    }
+
+    qSort(result);
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+}
+
+QRectF ScribbleStrokeIndex::strokeRect(const ScribbleStroke &stroke)
+{
+    if (stroke.getNumPoints() == 0)
+        return QRectF();
+    qreal a = stroke.getPenWidth() / 2.0;
+    return stroke.getBoundingRect().adjusted(-a, -a, a, a);
+}
+
+QRect ScribbleStrokeIndex::cellRange(const QRectF &rect)
+{
+    /* the keys only use 16 bits per coordinate, so clamp
+     * (the query results are only candidates anyway) */
+    const qreal limit = qreal(cellSize) * 0x7fff;
+    int left = qFloor(qBound(-limit, rect.left(), limit) / cellSize);
+    int top = qFloor(qBound(-limit, rect.top(), limit) / cellSize);
+    int right = qFloor(qBound(-limit, rect.right(), limit) / cellSize);
+    int bottom = qFloor(qBound(-limit, rect.bottom(), limit) / cellSize);
+    return QRect(QPoint(left, top), QPoint(right, bottom));
+}
+
+void ScribbleStrokeIndex::insertSorted(QVector<int> &list, int stroke)
+{
+    QVector<int>::iterator it = qLowerBound(list.begin(), list.end(), stroke);
+    if (it == list.end() || *it != stroke)
+        list.insert(it, stroke);
+}
+
+void ScribbleStrokeIndex::removeSorted(QVector<int> &list, int stroke)
+{
+    QVector<int>::iterator it = qBinaryFind(list.begin(), list.end(), stroke);
+    if (it != list.end())
+        list.erase(it);
+}
+
+/* ---------------------------------------------------------------- */
+
+void ScribbleLayer::appendStroke(const ScribbleStroke &stroke)
+{
+    items.append(stroke);
+    ids.append(nextId ++);
+    indexOfId.append(items.length() - 1);
+    spatialIndex.insert(ids.last(), ScribbleStrokeIndex::strokeRect(stroke));
+}
+
+void ScribbleLayer::appendPoint(int stroke, const QPointF &point)
+{
+    QRectF oldRect = ScribbleStrokeIndex::strokeRect(items[stroke]);
+    items[stroke].appendPoint(point);
+    spatialIndex.extend(ids[stroke], oldRect, ScribbleStrokeIndex::strokeRect(items[stroke]));
+}
+
+void ScribbleLayer::appendPoints(int stroke, const float *x, const float *y, int n)
+{
+    QRectF oldRect = ScribbleStrokeIndex::strokeRect(items[stroke]);
+    items[stroke].appendPoints(x, y, n);
+    spatialIndex.extend(ids[stroke], oldRect, ScribbleStrokeIndex::strokeRect(items[stroke]));
+}
+
+void ScribbleLayer::replaceStrokes(int index, int count, const QList<ScribbleStroke> &strokes)
+{
+    for (int i = 0; i < count; i ++) {
+        spatialIndex.remove(ids[index + i], ScribbleStrokeIndex::strokeRect(items[index + i]));
+        indexOfId[ids[index + i]] = -1;
+    }
+    for (int i = 0; i < count; i ++)
+        items.removeAt(index);
+    ids.remove(index, count);
+    for (int i = 0; i < strokes.length(); i ++) {
+        items.insert(index + i, strokes[i]);
+        ids.insert(index + i, nextId ++);
+        indexOfId.append(index + i);
+        spatialIndex.insert(ids[index + i], ScribbleStrokeIndex::strokeRect(strokes[i]));
+    }
+    /* the strokes behind keep their IDs, only their position changes */
+    if (strokes.length() != count) {
+        for (int i = index + strokes.length(); i < items.length(); i ++)
+            indexOfId[ids[i]] = i;
+    }
+    if (nextId > 2 * items.length() + 1024)
+        renumber();
+}
+
+QVector<int> ScribbleLayer::strokesNear(const QRectF &rect) const
+{
+    QVector<int> result = spatialIndex.query(rect);
+    for (int i = 0; i < result.size(); i ++)
+        result[i] = indexOfId[result[i]];
+    qSort(result);
+    return result;
+}
+
+void ScribbleLayer::renumber()
+{
+    spatialIndex = ScribbleStrokeIndex();
+    ids.resize(items.length());
+    for (int i = 0; i < items.length(); i ++) {
+        ids[i] = i;
+        spatialIndex.insert(i, ScribbleStrokeIndex::strokeRect(items[i]));
+    }
+    indexOfId = ids;
+    nextId = items.length();
+}
+
+/* ---------------------------------------------------------------- */
+
+int ScribblePage::newRevision()
+{
+    static QAtomicInt revisionCounter(0);
+    return revisionCounter.fetchAndAddRelaxed(1) + 1;
+}
+
+/* Parses with XournalParser and falls back to QXmlSimpleReader for
+ * documents it does not support. */
+static bool parseXournalData(QByteArray data, bool lazyPages, QString *title, QList<ScribblePage> *pages)
+{
+    XournalParser parser;
+    XournalParser::Result result = parser.parse(data, lazyPages);
+    if (result == XournalParser::UNSUPPORTED && lazyPages) {
+        /* e.g. unusual nesting, try to parse the pages right away */
+        result = parser.parse(data, false);
+    }
+    if (result == XournalParser::OK) {
+        *title = parser.getTitle();
+        *pages = parser.getPages();
+        return true;
+    } else if (result == XournalParser::ERROR) {
+        /* TODO message box */
+        qDebug() << "Parsing error:" << parser.errorString();
+        return false;
+    }
+
+    /* document uses XML features the fast parser does not handle */
+    QBuffer dataBuffer(&data);
+    QXmlInputSource source(&dataBuffer);
+    QXmlSimpleReader reader;
+    XournalXMLHandler handler;
+    reader.setContentHandler(&handler);
+    reader.setErrorHandler(&handler);
+    if (!reader.parse(&source, false)) {
+        /* TODO message box */
+        qDebug() << "Parsing error:" << handler.errorString();
+        return false;
+    }
+    *title = handler.getTitle();
+    *pages = handler.getPages();
+    return true;
+}
+
+bool ScribblePage::ensureLoaded()
+{
+    if (loaded)
+        return !damaged;
+    loaded = true;
+
+    QString title;
+    QList<ScribblePage> parsed;
+    bool ok;
+    if (damaged)
+        ok = false;
+    else if (hasNativeBlock())
+        ok = NativeFormat::readPage(nativeBlock, this);
+    else
+        ok = parseXournalData(xmlCache, false, &title, &parsed) && parsed.length() == 1;
+    if (!ok) {
+        qWarning() << "Page could not be loaded.";
+        /* shown empty, the XML (or the native block) is kept as it is */
+        layers.clear();
+        layers.append(ScribbleLayer());
+        damaged = true;
+        return false;
+    }
+    if (hasNativeBlock())
+        return true;
+    /* the XML cache and the revision stay, the content did not change */
+    layers = parsed[0].layers;
+    size = parsed[0].size;
+    background = parsed[0].background;
+    return true;
 }
 
 QByteArray ScribblePage::getXmlRepresentation() const
 {
-    /* TODO Can we cache this? During autosave, it is computed in the
-     * other thread. Getting the information back would save
-     * quite some CPU. */
+    if (hasXmlCache())
+        return xmlCache;
+    if (!loaded) {
+        /* a page of a native file */
+        ScribblePage copy = *this;
+        if (!copy.ensureLoaded())
+            return QByteArray();
+        return copy.buildXmlRepresentation();
+    }
+    if (damaged)
+        return QByteArray();
+    return buildXmlRepresentation();
+}
+
+QByteArray ScribblePage::buildXmlRepresentation() const
+{
     QByteArray output;
     output += QString().sprintf("<page width=\"%.2f\" height=\"%.2f\">\n",
                                 size.width(),
@@ -81,32 +590,15 @@ QByteArray ScribblePage::getXmlRepresentation() const
 
     foreach (const ScribbleLayer &layer, layers) {
         output += "<layer>\n";
-        foreach (const ScribbleStroke &stroke, layer.items) {
+        foreach (const ScribbleStroke &stroke, layer.getStrokes()) {
             QColor color = stroke.getPen().color();
             quint32 colorVal = (((((color.red() << 8) | color.green()) << 8) | color.blue()) << 8) | color.alpha();
             output += QString().sprintf("<stroke tool=\"pen\" color=\"#%08x\" width=\"%.2f\">",
                      colorVal, stroke.getPen().widthF()).toUtf8();
-            int pos = output.size();
-            QPolygonF points(stroke.getPoints());
-            if (points.size() == 1) {
-                /* add a second point */
-                points.append(points[0]);
-            }
-            output.resize(output.size() + points.size() * 14);
-            foreach (const QPointF &point, points) {
-                int written;
-                while (1) {
-                    written = snprintf(output.data() + pos, output.size() - pos,
-                                   "%.2f %.2f ", point.x(), point.y());
-                    if (written >= output.size() - pos) {
-                        output.resize(output.size() + 1024);
-                    } else {
-                        break;
-                    }
-                }
-                pos += written;
-            }
-            output.resize(pos);
+            CoordinateCodec::appendPoints(output, stroke.getXData(), stroke.getYData(), stroke.getNumPoints());
+            /* add a second point if there is only one */
+            if (stroke.getNumPoints() == 1)
+                CoordinateCodec::appendPoints(output, stroke.getXData(), stroke.getYData(), 1);
             output += "\n</stroke>\n";
             /* TODO error for text items */
         }
@@ -161,7 +653,6 @@ bool XournalXMLHandler::startElement(const QString &namespaceURI, const QString
         }
 
         QPen pen;
-        ScribbleStroke stroke;
         QString color = atts.value("color");
         bool ok;
         if (xournal_colors.contains(color)) {
@@ -184,8 +675,8 @@ bool XournalXMLHandler::startElement(const QString &namespaceURI, const QString
             return false;
         }
         /* XXX variable width (multiple float values separated by whitespace) */
-        stroke.setPen(pen);
-        pages.last().layers.last().items.append(stroke);
+        currentStroke = ScribbleStroke();
+        currentStroke.setPen(pen);
     } else if (localName == "page") {
         ScribblePage p;
         bool ok1, ok2;
@@ -223,35 +714,15 @@ bool XournalXMLHandler::endElement(const QString &namespaceURI, const QString &l
     Q_UNUSED(qName);
 
     if (localName == "stroke") {
-        ScribbleStroke &s = pages.last().layers.last().items.last();
-        QByteArray chunk;
-        QVector<QPointF> points;
-        float x;
-        bool xValid = false;
-        for (int i = 0; i < currentStrokeString.length(); i ++) {
-            char c = currentStrokeString[i];
-            if (('0' <= c && c <= '9') || c == '.' || c == '+' || c == '-' || c == 'e' || c == 'E') {
-                chunk += c;
-            } else if (c == ' ' || c == '\n' || c == '\r') {
-                if (!chunk.isEmpty()) {
-                    float v = chunk.toFloat();
-                    chunk.clear();
-                    if (xValid) {
-                        points.append(QPointF(x, v));
-                    } else {
-                        x = v;
-                    }
-                    xValid = !xValid;
-                }
-            } else {
-                parseError("Document contains invalid character in stroke description.");
-                return false;
-            }
-        }
-        if (!chunk.isEmpty() && xValid) {
-            points.append(QPointF(x, chunk.toFloat()));
+        QVector<float> xs, ys;
+        if (!CoordinateCodec::parsePoints(currentStrokeString.constData(),
+                                          currentStrokeString.constData() + currentStrokeString.size(),
+                                          &xs, &ys)) {
+            parseError("Document contains invalid character in stroke description.");
+            return false;
         }
-        s.appendPoints(points);
+        currentStroke.setPoints(xs, ys);
+        pages.last().layers.last().appendStroke(currentStroke);
         currentStrokeString.clear();
     }
     currentLocalName.clear();
@@ -304,91 +775,178 @@ bool XournalXMLHandler::fatalError(const QXmlParseException & exception)
 /* --------------------------------------------------------------- */
 
 bool EraserContext::erase(const ScribbleStroke *stroke, QList<ScribbleStroke> *removedStrokes, QList<ScribbleStroke> *newStrokes,
-                          const QPointF &point, qreal width)
+                          const QPolygonF &path, qreal width)
 {
-    this->stroke = stroke;
-    this->removedStrokes = removedStrokes;
-    this->newStrokes = newStrokes;
-
-    previousPointRemoved = false;
-    previousChangeIndex = 0;
-
-    qreal halfWidthSq = width * width / 4.0;
+    int n = stroke->getNumPoints();
+    if (n == 0 || path.isEmpty())
+        return false;
+    const float *x = stroke->getXData();
+    const float *y = stroke->getYData();
+    /* the stroke is hit as soon as its ink touches the eraser */
+    qreal radius = (width + stroke->getPenWidth()) / 2.0;
+
+    hits.resize(n);
+    int numHits;
+    if (path.size() == 1) {
+        numHits = EraserKernel::segmentsNearPoint(x, y, n, path[0].x(), path[0].y(), radius, hits.data());
+    } else {
+        pathHits.resize(n);
+        hits.fill(0);
+        for (int j = 0; j + 1 < path.size(); j ++) {
+            EraserKernel::segmentsNearSegment(x, y, n, path[j].x(), path[j].y(),
+                                              path[j + 1].x(), path[j + 1].y(), radius, pathHits.data());
+            for (int i = 0; i < n; i ++)
+                hits[i] |= pathHits[i];
+        }
+        numHits = 0;
+        for (int i = 0; i < n; i ++)
+            numHits += hits[i];
+    }
+    if (numHits == 0)
+        return false;
+    if (n == 1) {
+        removedStrokes->append(*stroke);
+        return true;
+    }
 
-    /* TODO avoid creating strokes with only one point */
+    keptX.clear();
+    keptY.clear();
+    erasedX.clear();
+    erasedY.clear();
+    bool changed = false;
+    for (int i = 0; i + 1 < n; i ++) {
+        if (!hits[i] || !clipSegment(x[i], y[i], x[i + 1], y[i + 1], path, radius)) {
+            /* the whole segment is kept */
+            finishPart(stroke, erasedX, erasedY, removedStrokes);
+            if (keptX.isEmpty())
+                appendPoint(keptX, keptY, x[i], y[i]);
+            appendPoint(keptX, keptY, x[i + 1], y[i + 1]);
+            continue;
+        }
 
-    /* we only check intersections with points, not
-     * line segments */
-    for (int i = 0; i < stroke->getPoints().size(); i ++) {
-        QPointF p = stroke->getPoints()[i] - point;
-        qreal d = p.x() * p.x() + p.y() * p.y();
-        if (d <= halfWidthSq) {
-            /* remove point */
-            if (!previousPointRemoved) {
-                appendFromPreviousChangeIndexUpTo(i, newStrokes);
+        changed = true;
+        qreal dx = x[i + 1] - x[i];
+        qreal dy = y[i + 1] - y[i];
+        qreal end = 0;
+        for (int k = 0; k < intervals.size(); k ++) {
+            qreal t0 = intervals[k].first;
+            qreal t1 = intervals[k].second;
+            if (t0 > 0) {
+                /* kept up to t0 */
+                if (keptX.isEmpty())
+                    appendPoint(keptX, keptY, x[i], y[i]);
+                appendPoint(keptX, keptY, x[i] + t0 * dx, y[i] + t0 * dy);
+                finishPart(stroke, keptX, keptY, newStrokes);
+                finishPart(stroke, erasedX, erasedY, removedStrokes);
+                appendPoint(erasedX, erasedY, x[i] + t0 * dx, y[i] + t0 * dy);
+            } else {
+                finishPart(stroke, keptX, keptY, newStrokes);
+                if (erasedX.isEmpty())
+                    appendPoint(erasedX, erasedY, x[i], y[i]);
             }
-            previousPointRemoved = true;
-        } else {
-            /* retain point */
-            if (previousPointRemoved) {
-                appendFromPreviousChangeIndexUpTo(i, removedStrokes);
+            appendPoint(erasedX, erasedY, x[i] + t1 * dx, y[i] + t1 * dy);
+            if (t1 < 1) {
+                /* kept again from t1 */
+                finishPart(stroke, erasedX, erasedY, removedStrokes);
+                appendPoint(keptX, keptY, x[i] + t1 * dx, y[i] + t1 * dy);
             }
-            previousPointRemoved = false;
+            end = t1;
         }
+        if (end < 1)
+            appendPoint(keptX, keptY, x[i + 1], y[i + 1]);
+    }
+
+    if (!changed) {
+        /* only close to the stroke, the lists are untouched */
+        return false;
     }
-    eraseEnded();
-    return previousPointRemoved || previousChangeIndex > 0;
+    finishPart(stroke, keptX, keptY, newStrokes);
+    finishPart(stroke, erasedX, erasedY, removedStrokes);
+    return true;
 }
 
-void EraserContext::eraseEnded()
+bool EraserContext::clipSegment(qreal ax, qreal ay, qreal bx, qreal by, const QPolygonF &path, qreal radius)
 {
-    int endIndex = stroke->getPoints().size() - 1;
-    if (previousPointRemoved) {
-        appendFromPreviousChangeIndexUpTo(endIndex, removedStrokes);
-    } else {
-        if (previousChangeIndex == 0) {
-            /* nothing happened */
-            return;
-        } else {
-            appendFromPreviousChangeIndexUpTo(endIndex, newStrokes);
-        }
+    intervals.clear();
+    qreal t0, t1;
+    if (path.size() == 1) {
+        if (EraserKernel::clipSegmentToCircle(ax, ay, bx, by, path[0].x(), path[0].y(), radius, &t0, &t1))
+            intervals.append(qMakePair(t0, t1));
+        return !intervals.isEmpty();
+    }
+    for (int j = 0; j + 1 < path.size(); j ++) {
+        if (EraserKernel::clipSegmentToCapsule(ax, ay, bx, by, path[j].x(), path[j].y(),
+                                               path[j + 1].x(), path[j + 1].y(), radius, &t0, &t1))
+            intervals.append(qMakePair(t0, t1));
     }
+    if (intervals.size() <= 1)
+        return !intervals.isEmpty();
+
+    /* the path can cross the segment several times, merge the overlapping parts */
+    std::sort(intervals.begin(), intervals.end());
+    int merged = 0;
+    for (int k = 1; k < intervals.size(); k ++) {
+        if (intervals[k].first <= intervals[merged].second)
+            intervals[merged].second = qMax(intervals[merged].second, intervals[k].second);
+        else
+            intervals[++ merged] = intervals[k];
+    }
+    intervals.resize(merged + 1);
+    return true;
 }
 
-void EraserContext::appendFromPreviousChangeIndexUpTo(int endIndex, QList<ScribbleStroke> *list)
+void EraserContext::finishPart(const ScribbleStroke *stroke, QVector<float> &xs, QVector<float> &ys,
+                               QList<ScribbleStroke> *list)
 {
-    if (endIndex > previousChangeIndex) {
-        list->append(ScribbleStroke(stroke->getPen(),
-                                    stroke->getPoints().mid(previousChangeIndex,
-                                                            endIndex - previousChangeIndex + 1)));
+    if (xs.size() >= 2) {
+        /* copies only the pen */
+        ScribbleStroke part(*stroke, 0, 0);
+        part.setPoints(xs, ys);
+        list->append(part);
     }
-    previousChangeIndex = endIndex;
+    /* not clear(), the new strokes share the data */
+    xs = QVector<float>();
+    ys = QVector<float>();
 }
 
 /* --------------------------------------------------------------- */
 
 ScribbleDocument::ScribbleDocument(QObject *parent) :
-    QObject(parent), title("")
+    QObject(parent), title(""), loadMode(LOAD_PAGES_LAZILY), simplificationTolerance(0),
+    history(new ScribbleHistory)
 {
+    connect(&pageCheck, SIGNAL(finished()), SLOT(pageCheckFinished()));
     initAfterLoad();
 }
 
-bool ScribbleDocument::loadXournalFile(QByteArray data)
+ScribbleDocument::~ScribbleDocument()
 {
-    QBuffer dataBuffer(&data);
-    QXmlInputSource source(&dataBuffer);
-    QXmlSimpleReader reader;
-    XournalXMLHandler handler;
-    reader.setContentHandler(&handler);
-    reader.setErrorHandler(&handler);
-    if (!reader.parse(&source, false)) {
-        /* TODO message box */
-        qDebug() << "Parsing error:" << handler.errorString();
+    delete history;
+}
+
+bool ScribbleDocument::loadXournalFile(QByteArray data, const QByteArray &journal, JournalResult *journalResult)
+{
+    if (journalResult != 0)
+        *journalResult = JOURNAL_NOT_APPLIED;
+
+    if (loadMode == LOAD_PAGES_IN_PARALLEL) {
+        if (!parsePagesInParallel(data, &title, &pages))
+            return false;
+    } else if (!parseXournalData(data, loadMode == LOAD_PAGES_LAZILY, &title, &pages)) {
         return false;
     }
-
-    title = handler.getTitle();
-    pages = handler.getPages();
+    if (!journal.isEmpty()) {
+        bool complete;
+        if (!ScribbleJournal::replay(journal, FileIO::checksum(data), pages, &complete)) {
+            qWarning() << "Ignoring journal that does not belong to the document.";
+        } else if (!complete) {
+            qWarning() << "Journal is damaged, only applied the records before the damage.";
+            if (journalResult != 0)
+                *journalResult = JOURNAL_PARTLY_APPLIED;
+        } else if (journalResult != 0) {
+            *journalResult = JOURNAL_APPLIED;
+        }
+    }
     initAfterLoad();
 
     /* TODO only save to this file again if we were able
@@ -399,28 +957,296 @@ bool ScribbleDocument::loadXournalFile(QByteArray data)
     return true;
 }
 
-QByteArray ScribbleDocument::toXournalXMLFormat()
+/* loads a page on a thread of the pool, counts the failures */
+class PageLoader
+{
+public:
+    typedef void result_type;
+
+    explicit PageLoader(QAtomicInt *failures) : failures(failures) {}
+    void operator()(ScribblePage &page) const {
+        if (!page.ensureLoaded())
+            failures->ref();
+    }
+
+private:
+    QAtomicInt *failures;
+};
+
+bool ScribbleDocument::parsePagesInParallel(const QByteArray &data, QString *title, QList<ScribblePage> *pages)
+{
+    /* split at the pages first, the pages are independent of each other */
+    QString parsedTitle;
+    QList<ScribblePage> parsedPages;
+    if (!parseXournalData(data, true, &parsedTitle, &parsedPages))
+        return false;
+
+    QAtomicInt failures(0);
+    QtConcurrent::blockingMap(parsedPages, PageLoader(&failures));
+    if (failures != 0) {
+        /* parse again sequentially, so the error (and its position) is
+         * reported exactly like in the other modes */
+        return parseXournalData(data, false, title, pages);
+    }
+
+    *title = parsedTitle;
+    *pages = parsedPages;
+    return true;
+}
+
+bool ScribbleDocument::loadNativeFile(const QString &fileName)
+{
+    QSharedPointer<QFile> file(new QFile(fileName));
+    if (!file->open(QIODevice::ReadOnly))
+        return false;
+    QByteArray data;
+    const uchar *mapped = file->map(0, file->size());
+    if (mapped != 0) {
+        data = QByteArray::fromRawData(reinterpret_cast<const char *>(mapped), file->size());
+    } else {
+        /* the pages copy their blocks instead */
+        data = file->readAll();
+        file.clear();
+    }
+
+    QString parsedTitle;
+    QList<ScribblePage> parsedPages;
+    if (!NativeFormat::read(data, file, &parsedTitle, &parsedPages) || parsedPages.isEmpty()) {
+        qDebug() << "Invalid native file:" << fileName;
+        return false;
+    }
+    if (loadMode != LOAD_PAGES_LAZILY) {
+        QAtomicInt failures(0);
+        if (loadMode == LOAD_PAGES_IN_PARALLEL)
+            QtConcurrent::blockingMap(parsedPages, PageLoader(&failures));
+        else
+            std::for_each(parsedPages.begin(), parsedPages.end(), PageLoader(&failures));
+        if (failures != 0) {
+            qDebug() << "Invalid native file:" << fileName;
+            return false;
+        }
+    }
+
+    title = parsedTitle;
+    pages = parsedPages;
+    initAfterLoad();
+    return true;
+}
+
+bool ScribbleDocument::writeNativeFile(const QString &fileName)
 {
-    return toXournalXMLFormat(pages);
+    QByteArray data;
+    if (!NativeFormat::write(title, getPagesCopy(), &data)) {
+        qDebug() << "Could not load all pages, not writing" << fileName;
+        return false;
+    }
+    QString tempFileName = fileName + ".tmp";
+    if (!FileIO::writeFileLocked(QFile(tempFileName), data)) {
+        QFile::remove(tempFileName);
+        return false;
+    }
+    if (!FileIO::replaceFile(tempFileName, fileName)) {
+        qWarning() << "Could not replace" << fileName;
+        QFile::remove(tempFileName);
+        return false;
+    }
+    return true;
 }
 
-QByteArray ScribbleDocument::toXournalXMLFormat(const QList<ScribblePage> &pages)
+/* loads copies of the pages that are not loaded yet, returns index and
+ * revision of those that cannot be loaded */
+static QList<QPair<int, int> > findDamagedPages(const QList<ScribblePage> &pages)
 {
-    setlocale(LC_NUMERIC, "C");
+    QList<QPair<int, int> > damaged;
+    for (int i = 0; i < pages.length(); i ++) {
+        if (pages[i].isLoaded())
+            continue;
+        ScribblePage copy = pages[i];
+        if (!copy.ensureLoaded())
+            damaged.append(qMakePair(i, copy.getRevision()));
+    }
+    return damaged;
+}
 
-    QByteArray output = "<?xml  version=\"1.0\" standalone=\"no\"?>\n"
-            "<xournal version=\"0.4.5\">\n"
-            "<title>Scribble document - see https://github.com/peter-x/scribble</title>\n";
+void ScribbleDocument::checkPages()
+{
+    QList<int> damaged;
     for (int i = 0; i < pages.length(); i ++) {
-        output += pages[i].getXmlRepresentation();
+        if (pages[i].isLoaded() && pages[i].isDamaged())
+            damaged.append(i);
+    }
+    if (!damaged.isEmpty())
+        emit pagesDamaged(damaged);
+    pageCheck.setFuture(QtConcurrent::run(findDamagedPages, pages));
+}
+
+void ScribbleDocument::pageCheckFinished()
+{
+    QList<QPair<int, int> > found = pageCheck.result();
+    QList<int> damaged;
+    for (int i = 0; i < found.length(); i ++) {
+        int page = found[i].first;
+        /* another document could have been loaded, or the page was
+         * loaded (and reported) in the meantime */
+        if (page < pages.length() && pages[page].getRevision() == found[i].second && !pages[page].isLoaded()) {
+            pages[page].setDamaged();
+            damaged.append(page);
+        }
+    }
+    if (!damaged.isEmpty())
+        emit pagesDamaged(damaged);
+}
+
+static const char *xournalXMLHeader =
+        "<?xml  version=\"1.0\" standalone=\"no\"?>\n"
+        "<xournal version=\"0.4.5\">\n"
+        "<title>Scribble document - see https://github.com/peter-x/scribble</title>\n";
+static const char *xournalXMLFooter = "</xournal>\n";
+
+QByteArray ScribbleDocument::toXournalXMLFormat()
+{
+    QList<ScribblePage> copy = getPagesCopy();
+    QVector<QByteArray> newFragments;
+    QByteArray output = toXournalXMLFormat(copy, &newFragments);
+    for (int i = 0; i < newFragments.size(); i ++) {
+        if (!newFragments[i].isNull())
+            setPageXmlCache(i, copy[i].getRevision(), newFragments[i]);
     }
-    output += "</xournal>\n";
+    return output;
+}
 
-    setlocale(LC_NUMERIC, "");
+static QByteArray pageXmlRepresentation(const ScribblePage &page)
+{
+    return page.getXmlRepresentation();
+}
+
+/* XML representations of count pages starting at from, in order */
+static QList<QByteArray> pagesXmlRepresentation(const QList<ScribblePage> &pages, int from, int count, bool parallel)
+{
+    if (parallel && count > 1)
+        return QtConcurrent::blockingMapped<QList<QByteArray> >(pages.mid(from, count), pageXmlRepresentation);
+    QList<QByteArray> xml;
+    for (int i = from; i < from + count; i ++)
+        xml.append(pages[i].getXmlRepresentation());
+    return xml;
+}
+
+QByteArray ScribbleDocument::toXournalXMLFormat(const QList<ScribblePage> &pages, QVector<QByteArray> *newFragments,
+                                                bool parallel)
+{
+    if (newFragments != 0) {
+        newFragments->clear();
+        newFragments->resize(pages.length());
+    }
+
+    QByteArray output = xournalXMLHeader;
+    if (!parallel) {
+        for (int i = 0; i < pages.length(); i ++) {
+            QByteArray xml = pages[i].getXmlRepresentation();
+            if (xml.isNull())
+                return QByteArray();
+            if (newFragments != 0 && !pages[i].hasXmlCache())
+                (*newFragments)[i] = xml;
+            output += xml;
+        }
+    } else {
+        QList<QByteArray> xml = pagesXmlRepresentation(pages, 0, pages.length(), true);
+        int size = output.size() + strlen(xournalXMLFooter);
+        for (int i = 0; i < xml.length(); i ++) {
+            if (xml[i].isNull())
+                return QByteArray();
+            size += xml[i].size();
+        }
+        output.reserve(size);
+        for (int i = 0; i < pages.length(); i ++) {
+            if (newFragments != 0 && !pages[i].hasXmlCache())
+                (*newFragments)[i] = xml[i];
+            output += xml[i];
+        }
+    }
+    output += xournalXMLFooter;
 
     return output;
 }
 
+/* fills the XML caches of the document while it is written */
+class XmlCacheFiller : public ScribbleXmlFragmentReceiver
+{
+public:
+    explicit XmlCacheFiller(ScribbleDocument *document) : document(document) {}
+    void xmlFragmentComputed(int page, int revision, const QByteArray &xml) {
+        document->setPageXmlCache(page, revision, xml);
+    }
+private:
+    ScribbleDocument *document;
+};
+
+bool ScribbleDocument::writeXournalFile(const QFile &file, int compressionLevel, int compressionThreads,
+                                        quint32 *checksum)
+{
+    QList<ScribblePage> copy = getPagesCopy();
+    XmlCacheFiller filler(this);
+    GZFileWriter writer(file, compressionLevel, compressionThreads);
+    bool success = false;
+    if (writeXournalFile(copy, writer, &filler))
+        success = writer.close();
+    else
+        writer.abort();
+    if (checksum != 0)
+        *checksum = writer.checksum();
+    return success;
+}
+
+bool ScribbleDocument::writeXournalFile(const QList<ScribblePage> &pages, GZFileWriter &writer,
+                                        ScribbleXmlFragmentReceiver *receiver, bool parallel)
+{
+    /* the document is never assembled in one buffer, only the pages
+     * that are currently written (and the XML caches) are in memory */
+    int batchSize = 1;
+    if (parallel)
+        batchSize = qMax(1, 2 * QThreadPool::globalInstance()->maxThreadCount());
+
+    bool ok = writer.write(xournalXMLHeader);
+    for (int i = 0; i < pages.length() && ok; i += batchSize) {
+        int count = qMin(batchSize, pages.length() - i);
+        QList<QByteArray> xml = pagesXmlRepresentation(pages, i, count, parallel);
+        for (int j = 0; j < count && ok; j ++) {
+            /* damaged pages of a native file cannot be written as XML */
+            ok = !xml[j].isNull() && writer.write(xml[j]);
+            if (ok && receiver != 0 && !pages[i + j].hasXmlCache())
+                receiver->xmlFragmentComputed(i + j, pages[i + j].getRevision(), xml[j]);
+        }
+    }
+    return ok && writer.write(xournalXMLFooter);
+}
+
+QList<ScribblePage> ScribbleDocument::getPagesCopy() const
+{
+    QList<ScribblePage> copy = pages;
+    if (stylus.sketching && stylus.mode == stylus.PEN && currentStroke >= 0) {
+        ScribblePage &page = copy[currentPage];
+        page.layers[currentLayer].replaceStrokes(currentStroke, 1, QList<ScribbleStroke>());
+        page.invalidate();
+    }
+    return copy;
+}
+
+QByteArray ScribbleDocument::takeJournalRecords()
+{
+    QByteArray records = journalRecords;
+    journalRecords.clear();
+    return records;
+}
+
+void ScribbleDocument::setPageXmlCache(int page, int revision, const QByteArray &xml)
+{
+    if (page < 0 || page >= pages.length())
+        return;
+    if (pages[page].getRevision() != revision || pages[page].hasXmlCache())
+        return;
+    pages[page].setXmlCache(xml);
+}
+
 void ScribbleDocument::initAfterLoad()
 {
     if (pages.length() == 0) {
@@ -428,16 +1254,21 @@ void ScribbleDocument::initAfterLoad()
         pages[0].layers.append(ScribbleLayer());
         pages[0].invalidate();
     }
+    pages[0].ensureLoaded();
     currentPage = 0;
     currentLayer = getCurrentPage().layers.length() - 1;
 
     stylus.sketching = false;
     stylus.mode = stylus.PEN;
-    currentStroke = 0;
+    currentStroke = -1;
+    eraserPath.clear();
+    eraserPending = false;
     stylus.pen.setColor(QColor(0, 0, 0));
     stylus.pen.setWidth(2);
 
     changedSinceLastSave = false;
+    journalRecords.clear();
+    history->clear();
 
     emit pageOrLayerNumberChanged(currentPage, pages.length(), currentLayer, getCurrentPage().layers.length());
     emit pageOrLayerChanged(getCurrentPage(), currentLayer);
@@ -448,40 +1279,103 @@ void ScribbleDocument::endCurrentStroke()
     if (!stylus.sketching) return;
 
     if (stylus.mode == stylus.PEN) {
-        if (currentStroke != 0 && currentStroke->getPoints().size() == 1) {
-            currentStroke->appendPoint(currentStroke->getPoints()[0]);
+        ScribbleLayer &l = pages[currentPage].layers[currentLayer];
+        if (currentStroke >= 0) {
+            if (l.getStroke(currentStroke).getNumPoints() == 1) {
+                l.appendPoint(currentStroke, l.getStroke(currentStroke).getPoint(0));
+                pages[currentPage].invalidate();
+            }
+            if (simplificationTolerance > 0) {
+                ScribbleStroke s = l.getStroke(currentStroke);
+                if (s.simplify(simplificationTolerance)) {
+                    l.replaceStrokes(currentStroke, 1, QList<ScribbleStroke>() << s);
+                    pages[currentPage].invalidate();
+                }
+            }
+            QList<ScribbleStroke> completed;
+            completed << l.getStroke(currentStroke);
+            ScribbleJournal::appendStrokesReplaced(journalRecords, currentPage, currentLayer, currentStroke, 0,
+                                                   completed);
+            history->strokesReplaced(currentPage, currentLayer, currentStroke, QList<ScribbleStroke>(),
+                                     completed, l);
+            emit strokeCompleted(l.getStroke(currentStroke));
         }
-        emit strokeCompleted(*currentStroke);
-        currentStroke = 0;
+        currentStroke = -1;
+    } else if (stylus.mode == stylus.ERASER) {
+        flushEraser();
+        eraserPath.clear();
+        history->endStep();
     }
     stylus.sketching = false;
 }
 
+void ScribbleDocument::simplifyAllStrokes(qreal tolerance, int *pointsBefore, int *pointsAfter)
+{
+    endCurrentStroke();
+    /* a step for the whole document would exceed the memory limit */
+    history->clear();
+    int before = 0, after = 0;
+    for (int pi = 0; pi < pages.length(); pi ++) {
+        ScribblePage &page = pages[pi];
+        if (!page.ensureLoaded())
+            continue;
+        bool changed = false;
+        for (int li = 0; li < page.layers.length(); li ++) {
+            ScribbleLayer &l = page.layers[li];
+            for (int i = 0; i < l.getNumStrokes(); i ++) {
+                ScribbleStroke s = l.getStroke(i);
+                before += s.getNumPoints();
+                if (s.simplify(tolerance)) {
+                    QList<ScribbleStroke> simplified;
+                    simplified << s;
+                    l.replaceStrokes(i, 1, simplified);
+                    ScribbleJournal::appendStrokesReplaced(journalRecords, pi, li, i, 1, simplified);
+                    changed = true;
+                }
+                after += s.getNumPoints();
+            }
+        }
+        if (changed) {
+            page.invalidate();
+            changedSinceLastSave = true;
+        }
+    }
+    if (pointsBefore != 0)
+        *pointsBefore = before;
+    if (pointsAfter != 0)
+        *pointsAfter = after;
+    emit pageOrLayerChanged(getCurrentPage(), currentLayer);
+}
+
 bool ScribbleDocument::setCurrentPage(int index)
 {
     if (index < 0 || index >= pages.length())
         return false;
     endCurrentStroke();
-    if (currentLayer == getCurrentPage().layers.length() - 1) {
-        currentPage = index;
-        currentLayer = getCurrentPage().layers.length() - 1;
-    } else {
-        currentPage = index;
-        currentLayer = qMin(currentLayer, getCurrentPage().layers.length() - 1);
-    }
+    bool wasDamaged = pages[index].isDamaged();
+    bool loaded = pages[index].ensureLoaded();
+    bool topLayer = currentLayer == getCurrentPage().layers.length() - 1;
+    currentPage = index;
+    currentLayer = layerOnPage(getCurrentPage(), currentLayer, topLayer);
     emit pageOrLayerNumberChanged(currentPage, pages.length(), currentLayer, getCurrentPage().layers.length());
     emit pageOrLayerChanged(getCurrentPage(), currentLayer);
+    if (!loaded && !wasDamaged)
+        emit pagesDamaged(QList<int>() << index);
     return true;
 }
 
 void ScribbleDocument::nextPage()
 {
+    endCurrentStroke();
     if (currentPage + 1 >= pages.length()) {
         ScribblePage p;
         if (!currentViewSize.isEmpty())
             p.size = currentViewSize;
         p.layers.append(ScribbleLayer());
         pages.append(p);
+        ScribbleJournal::appendPageAdded(journalRecords, p.size);
+        history->pageAdded(p.size);
+        changedSinceLastSave = true;
     }
     setCurrentPage(currentPage + 1);
 }
@@ -496,8 +1390,12 @@ void ScribbleDocument::layerUp()
     endCurrentStroke();
     ScribblePage &p = pages[currentPage];
     if (currentLayer + 1 >= p.layers.length()) {
+        if (p.isDamaged())
+            return;
         p.layers.append(ScribbleLayer());
         p.invalidate();
+        ScribbleJournal::appendLayerAdded(journalRecords, currentPage);
+        history->layerAdded(currentPage);
         changedSinceLastSave = true;
     }
     currentLayer += 1;
@@ -516,72 +1414,116 @@ void ScribbleDocument::layerDown()
 
 void ScribbleDocument::touchEventDataReceived(const QPoint &pos, int pressure)
 {
-    if (!QRect(QPoint(0, 0), currentViewSize).contains(pos)) {
-        endCurrentStroke();
-        return;
+    touchEventDataReceived(QPolygon() << pos, pressure);
+}
+
+void ScribbleDocument::touchEventDataReceived(const QPolygon &positions, int pressure)
+{
+    QRect view(QPoint(0, 0), currentViewSize);
+    int i = 0;
+    while (i < positions.size()) {
+        if (!view.contains(positions[i])) {
+            endCurrentStroke();
+            i ++;
+            continue;
+        }
+        int end = i + 1;
+        while (end < positions.size() && view.contains(positions[end]))
+            end ++;
+        handleTouchSamples(positions, i, end, pressure);
+        i = end;
     }
+}
 
+void ScribbleDocument::handleTouchSamples(const QPolygon &positions, int from, int to, int pressure)
+{
+    /* damaged pages are kept as they were read */
+    if (getCurrentPage().isDamaged())
+        return;
     if (stylus.mode == stylus.ERASER) {
         if (pressure > 0) {
+            /* the whole movement is undone at once */
+            if (!stylus.sketching)
+                history->beginStep();
             stylus.sketching = true;
-            eraseAt(pos);
+            for (int i = from; i < to; i ++)
+                eraserPath.append(positions[i]);
+            if (!eraserPending) {
+                eraserPending = true;
+                QTimer::singleShot(0, this, SLOT(flushEraser()));
+            }
         } else {
-            stylus.sketching = false;
+            endCurrentStroke();
         }
     } else if (stylus.mode == stylus.PEN){
         if (pressure > 0) {
+            ScribbleLayer &l = pages[currentPage].layers[currentLayer];
             if (!stylus.sketching) {
                 stylus.sketching = true;
-                ScribbleLayer &l = pages[currentPage].layers[currentLayer];
-                l.items.append(ScribbleStroke(stylus.pen, QPolygonF()));
-                currentStroke = &l.items.last();
+                l.appendStroke(ScribbleStroke(stylus.pen, QPolygonF()));
+                currentStroke = l.getNumStrokes() - 1;
+            }
+            int n = to - from;
+            QVector<float> x(n), y(n);
+            for (int i = 0; i < n; i ++) {
+                x[i] = positions[from + i].x();
+                y[i] = positions[from + i].y();
             }
-            currentStroke->appendPoint(pos);
+            l.appendPoints(currentStroke, x.constData(), y.constData(), n);
             pages[currentPage].invalidate();
             changedSinceLastSave = true;
-            emit strokePointAdded(*currentStroke);
+            emit strokePointsAdded(l.getStroke(currentStroke), n);
         } else if (stylus.sketching) {
             endCurrentStroke();
         }
     }
 }
 
-void ScribbleDocument::eraseAt(const QPointF &point)
+void ScribbleDocument::flushEraser()
+{
+    if (!eraserPending)
+        return;
+    eraserPending = false;
+    eraseAlong(eraserPath);
+    QPointF last = eraserPath.last();
+    eraserPath.clear();
+    eraserPath.append(last);
+}
+
+void ScribbleDocument::eraseAlong(const QPolygonF &path)
 {
     ScribbleLayer &layer = pages[currentPage].layers[currentLayer];
 
     qreal width = stylus.pen.widthF();
-    QRectF eraserBox;
-    eraserBox.setSize(QSizeF(width, width));
-    eraserBox.moveCenter(point);
+    QRectF eraserBox = path.boundingRect().adjusted(-width / 2, -width / 2, width / 2, width / 2);
 
     QList<ScribbleStroke> removedStrokes;
     QList<ScribbleStroke> newStrokes;
 
     EraserContext eraserContext;
 
-    for (int i = 0; i < layer.items.length(); i ++) {
-        ScribbleStroke &s = layer.items[i];
-        if (!s.boundingRectIntersects(eraserBox))
+    QVector<int> candidates = layer.strokesNear(eraserBox);
+    /* go backwards so that replacing a stroke does not change the
+     * indices of the candidates that are still to be visited */
+    for (int k = candidates.size() - 1; k >= 0; k --) {
+        int i = candidates[k];
+        const ScribbleStroke &s = layer.getStroke(i);
+        /* includes the whole pen, the eraser hits the ink */
+        if (!ScribbleStrokeIndex::strokeRect(s).intersects(eraserBox))
             continue;
 
-        if (!eraserContext.erase(&s, &removedStrokes, &newStrokes, point, width)) {
+        if (!eraserContext.erase(&s, &removedStrokes, &newStrokes, path, width)) {
             /* nothing removed */
             continue;
         }
 
-        if (newStrokes.isEmpty()) {
-            /* stroke removed completely */
-            layer.items.removeAt(i);
-            i -= 1;
-        } else {
-            layer.items[i] = newStrokes[0];
-            for (int j = 1; j < newStrokes.length(); j ++) {
-                layer.items.insert(i + j, newStrokes[j]);
-            }
-            i += newStrokes.length() - 1;
-            newStrokes.clear();
-        }
+        QList<ScribbleStroke> oldStrokes;
+        oldStrokes << s;
+        /* removes the stroke completely if newStrokes is empty */
+        layer.replaceStrokes(i, 1, newStrokes);
+        ScribbleJournal::appendStrokesReplaced(journalRecords, currentPage, currentLayer, i, 1, newStrokes);
+        history->strokesReplaced(currentPage, currentLayer, i, oldStrokes, newStrokes, layer);
+        newStrokes.clear();
     }
 
     if (!removedStrokes.isEmpty()) {
@@ -590,3 +1532,144 @@ void ScribbleDocument::eraseAt(const QPointF &point)
         emit strokesChanged(getCurrentPage(), currentLayer, removedStrokes);
     }
 }
+
+void ScribbleDocument::setHistoryLimit(int bytes)
+{
+    history->setMaxBytes(bytes);
+}
+
+bool ScribbleDocument::canUndo() const
+{
+    return history->canUndo();
+}
+
+bool ScribbleDocument::canRedo() const
+{
+    return history->canRedo();
+}
+
+void ScribbleDocument::undo()
+{
+    endCurrentStroke();
+    ScribbleHistory::Step step;
+    if (!history->undo(&step))
+        return;
+
+    int page = currentPage;
+    int layer = currentLayer;
+    bool structureChanged = false;
+    QList<ScribbleStroke> changed;
+    for (int i = step.length() - 1; i >= 0; i --) {
+        const ScribbleHistory::Operation &op = step[i];
+        if (op.type == ScribbleHistory::Operation::STROKES_REPLACED) {
+            replaceStrokes(op.page, op.layer, op.index, op.newStrokes.length(), op.oldStrokes);
+            /* strokesChanged only covers the current layer */
+            if (op.page != page || op.layer != layer) {
+                structureChanged = true;
+                page = op.page;
+                layer = op.layer;
+            }
+            changed += ScribbleHistory::changedStrokes(op);
+        } else if (op.type == ScribbleHistory::Operation::PAGE_ADDED) {
+            removeLastPage();
+            layer = -1;
+            structureChanged = true;
+        } else if (op.type == ScribbleHistory::Operation::LAYER_ADDED) {
+            removeLastLayer(op.page);
+            page = op.page;
+            layer = -1;
+            structureChanged = true;
+        }
+    }
+    showUndoneChanges(page, layer, structureChanged, changed);
+}
+
+void ScribbleDocument::redo()
+{
+    endCurrentStroke();
+    ScribbleHistory::Step step;
+    if (!history->redo(&step))
+        return;
+
+    int page = currentPage;
+    int layer = currentLayer;
+    bool structureChanged = false;
+    QList<ScribbleStroke> changed;
+    for (int i = 0; i < step.length(); i ++) {
+        const ScribbleHistory::Operation &op = step[i];
+        if (op.type == ScribbleHistory::Operation::STROKES_REPLACED) {
+            replaceStrokes(op.page, op.layer, op.index, op.oldStrokes.length(), op.newStrokes);
+            /* strokesChanged only covers the current layer */
+            if (op.page != page || op.layer != layer) {
+                structureChanged = true;
+                page = op.page;
+                layer = op.layer;
+            }
+            changed += ScribbleHistory::changedStrokes(op);
+        } else if (op.type == ScribbleHistory::Operation::PAGE_ADDED) {
+            ScribblePage p;
+            p.size = op.size;
+            p.layers.append(ScribbleLayer());
+            pages.append(p);
+            ScribbleJournal::appendPageAdded(journalRecords, p.size);
+            page = pages.length() - 1;
+            layer = 0;
+            structureChanged = true;
+        } else if (op.type == ScribbleHistory::Operation::LAYER_ADDED) {
+            pages[op.page].ensureLoaded();
+            pages[op.page].layers.append(ScribbleLayer());
+            pages[op.page].invalidate();
+            ScribbleJournal::appendLayerAdded(journalRecords, op.page);
+            page = op.page;
+            layer = pages[op.page].layers.length() - 1;
+            structureChanged = true;
+        }
+    }
+    changedSinceLastSave = true;
+    showUndoneChanges(page, layer, structureChanged, changed);
+}
+
+void ScribbleDocument::replaceStrokes(int page, int layer, int index, int count, const QList<ScribbleStroke> &strokes)
+{
+    pages[page].ensureLoaded();
+    pages[page].layers[layer].replaceStrokes(index, count, strokes);
+    pages[page].invalidate();
+    ScribbleJournal::appendStrokesReplaced(journalRecords, page, layer, index, count, strokes);
+    changedSinceLastSave = true;
+}
+
+void ScribbleDocument::removeLastPage()
+{
+    pages.removeLast();
+    ScribbleJournal::appendPageRemoved(journalRecords);
+    changedSinceLastSave = true;
+}
+
+void ScribbleDocument::removeLastLayer(int page)
+{
+    pages[page].ensureLoaded();
+    pages[page].layers.removeLast();
+    pages[page].invalidate();
+    ScribbleJournal::appendLayerRemoved(journalRecords, page);
+    changedSinceLastSave = true;
+}
+
+void ScribbleDocument::showUndoneChanges(int page, int layer, bool structureChanged,
+                                         const QList<ScribbleStroke> &strokes)
+{
+    if (!structureChanged) {
+        emit strokesChanged(getCurrentPage(), currentLayer, strokes);
+        return;
+    }
+    /* the current page or layer could be gone, show the changed page */
+    page = qMin(page, pages.length() - 1);
+    pages[page].ensureLoaded();
+    bool topLayer = currentLayer >= pages[qMin(currentPage, pages.length() - 1)].layers.length() - 1;
+    currentPage = page;
+    if (layer >= 0 && layer < getCurrentPage().layers.length())
+        currentLayer = layer;
+    else
+        currentLayer = layerOnPage(getCurrentPage(), currentLayer, topLayer);
+    emit pageOrLayerNumberChanged(currentPage, pages.length(), currentLayer, getCurrentPage().layers.length());
+    emit pageOrLayerChanged(getCurrentPage(), currentLayer);
+}
@@ -26,42 +26,149 @@
 #include <QPoint>
 #include <QColor>
 #include <QHash>
+#include <QPair>
 #include <QPen>
+#include <QPolygon>
 #include <QPolygonF>
+#include <QSharedPointer>
+#include <QVector>
 #include <QFile>
+#include <QFutureWatcher>
 #include <QMouseEvent>
 
 #include <QtXml/QXmlDefaultHandler>
 
-class ScribbleStroke
+#include "fileio.h"
+
+class ScribbleHistory;
+
+/* Pens are stored in the strokes as a small index into this table
+ * (there are usually only a handful of different pens in a document).
+ * The table only grows and is shared between all documents and threads.
+ * Entries never move or change once they are added, so reading them
+ * needs no lock, only adding a pen does. */
+class ScribblePenTable
 {
 public:
-    ScribbleStroke() {}
-    ScribbleStroke(const QPen &pen, const QPolygonF &points) : pen(pen), points(points) { updateBoundingRect(); }
-    const QPolygonF &getPoints() const { return points; }
-    const QPen &getPen() const { return pen; }
-    void setPen(const QPen &pen) { this->pen = pen; updateBoundingRect(); }
+    static quint16 indexOf(const QPen &pen);
+    /* index has to come from indexOf */
+    static const QPen &pen(quint16 index);
+};
 
-    const QRectF &getBoundingRect() const { return boundingRect; }
+/* The points are stored as two contiguous float arrays (structure of
+ * arrays), which needs half the memory of a QPolygonF. */
+class ScribbleStroke
+{
+public:
+    ScribbleStroke() : penIndex(0) { resetBounds(); }
+    ScribbleStroke(const QPen &pen, const QPolygonF &points);
+    /* copies the points from..from+count-1 of o */
+    ScribbleStroke(const ScribbleStroke &o, int from, int count);
+
+    /* creates a copy, prefer getNumPoints() and getPoint() */
+    QPolygonF getPoints() const;
+    int getNumPoints() const { return xs.size(); }
+    QPointF getPoint(int i) const { return QPointF(xs[i], ys[i]); }
+    const float *getXData() const { return xs.constData(); }
+    const float *getYData() const { return ys.constData(); }
+
+    const QPen &getPen() const { return ScribblePenTable::pen(penIndex); }
+    quint16 getPenIndex() const { return penIndex; }
+    qreal getPenWidth() const { return ScribblePenTable::pen(penIndex).widthF(); }
+    void setPen(const QPen &pen) { penIndex = ScribblePenTable::indexOf(pen); }
+
+    QRectF getBoundingRect() const;
     bool segmentIntersects(int i, const ScribbleStroke &o) const;
-    bool boundingRectIntersects(const ScribbleStroke &o) const { return boundingRectIntersects(o.boundingRect); }
-    bool boundingRectIntersects(const QRectF &r) const { return boundingRect.intersects(r); }
-    void appendPoint(const QPointF &p) { points.append(p); updateBoundingRect(); }
-    void appendPoints(const QVector<QPointF> &p) { points += p; updateBoundingRect(); }
+    bool boundingRectIntersects(const ScribbleStroke &o) const { return boundingRectIntersects(o.getBoundingRect()); }
+    bool boundingRectIntersects(const QRectF &r) const { return getBoundingRect().intersects(r); }
+    void appendPoint(const QPointF &p);
+    void appendPoints(const QVector<QPointF> &p);
+    void appendPoints(const float *x, const float *y, int n);
+    /* replaces all points, the vectors are shared and not copied */
+    void setPoints(const QVector<float> &x, const QVector<float> &y);
+    /* Removes points (Ramer-Douglas-Peucker) so that the polyline moves
+     * by at most tolerance, the end points stay. Returns false if no
+     * point was removed. */
+    bool simplify(qreal tolerance);
 
 private:
-    void updateBoundingRect();
+    void resetBounds();
+    void extendBounds(float x, float y);
 
-    QPen pen;
-    QPolygonF points;
+    quint16 penIndex;
+    QVector<float> xs;
+    QVector<float> ys;
+
+    /* bounds of the points only, the pen is added in getBoundingRect() */
+    float minX, minY, maxX, maxY;
+};
 
-    QRectF boundingRect;
+/* Uniform grid over the bounding rects of the strokes of a layer. It is
+ * used to find the strokes near a rect without looking at all strokes.
+ * Strokes are referenced by IDs that do not change when other strokes
+ * are inserted or removed (see ScribbleLayer), so the cells only change
+ * for the strokes that change. */
+class ScribbleStrokeIndex
+{
+public:
+    /* a null rect (see strokeRect()) is never indexed */
+    void insert(int stroke, const QRectF &rect);
+    /* the bounding rect of the stroke grew from oldRect to newRect */
+    void extend(int stroke, const QRectF &oldRect, const QRectF &newRect);
+    void remove(int stroke, const QRectF &rect);
+    /* sorted IDs of all strokes whose rect may intersect rect */
+    QVector<int> query(const QRectF &rect) const;
+
+    /* the rect that is used to index the stroke, includes the pen,
+     * null for strokes without points */
+    static QRectF strokeRect(const ScribbleStroke &stroke);
+
+private:
+    static const int cellSize = 64;
+    /* strokes that would cover more cells are kept in largeStrokes */
+    static const int maxCellsPerStroke = 64;
+
+    static QRect cellRange(const QRectF &rect);
+    static bool isLarge(const QRect &range) { return qint64(range.width()) * range.height() > maxCellsPerStroke; }
+    static quint32 cellKey(int x, int y) { return (quint32(x & 0xffff) << 16) | quint32(y & 0xffff); }
+    static void insertSorted(QVector<int> &list, int stroke);
+    static void removeSorted(QVector<int> &list, int stroke);
+
+    QHash<quint32, QVector<int> > cells;
+    QVector<int> largeStrokes;
 };
 
 class ScribbleLayer
 {
 public:
+    ScribbleLayer() : nextId(0) {}
+
+    const QList<ScribbleStroke> &getStrokes() const { return items; }
+    int getNumStrokes() const { return items.length(); }
+    const ScribbleStroke &getStroke(int i) const { return items[i]; }
+
+    void appendStroke(const ScribbleStroke &stroke);
+    void appendPoint(int stroke, const QPointF &point);
+    void appendPoints(int stroke, const float *x, const float *y, int n);
+    /* replaces count strokes starting at index by strokes, used to remove
+     * and to split strokes */
+    void replaceStrokes(int index, int count, const QList<ScribbleStroke> &strokes);
+
+    /* sorted indices of the strokes whose bounding rect (including the
+     * pen) may intersect rect */
+    QVector<int> strokesNear(const QRectF &rect) const;
+
+private:
+    /* gives the strokes the IDs 0..n-1 again, once many were replaced */
+    void renumber();
+
     QList<ScribbleStroke> items;
+    ScribbleStrokeIndex spatialIndex;
+    /* the ID of each stroke in spatialIndex */
+    QVector<int> ids;
+    /* the index in items of each ID, -1 for removed strokes */
+    QVector<int> indexOfId;
+    int nextId;
 };
 
 class ScribbleXournalBackground
@@ -80,34 +187,110 @@ public:
 class ScribblePage
 {
 public:
-    ScribblePage() : size(QSizeF(612, 792)) {} /* TODO use reasonable values */
+    ScribblePage() : size(QSizeF(612, 792)), loaded(true), damaged(false), revision(newRevision()) {} /* TODO use reasonable values */
     QList<ScribbleLayer> layers;
     QSizeF size;
     ScribbleXournalBackground background;
 
-    void invalidate() const {
-        /* TODO could be used to invalide cached XML representation */
+    /* A page that is not loaded only consists of its size and the XML
+     * it was read from, which is also its XML representation. Layers
+     * and background are only valid after ensureLoaded(). */
+    bool isLoaded() const { return loaded; }
+    void setUnloaded(const QByteArray &xml) {
+        layers.clear();
+        xmlCache = xml;
+        nativeBlock.clear();
+        nativeFile.clear();
+        loaded = false;
+        damaged = false;
     }
+    /* A page of a native file (see NativeFormat) that is not loaded
+     * refers to its block in the mapped file instead, file keeps the
+     * mapping valid. */
+    void setUnloadedNative(const QByteArray &block, const QSharedPointer<QFile> &file) {
+        layers.clear();
+        xmlCache.clear();
+        nativeBlock = block;
+        nativeFile = file;
+        loaded = false;
+        damaged = false;
+    }
+    /* parses the XML (or the native block) if the page is not loaded
+     * yet, returns false if that failed, the page is damaged then */
+    bool ensureLoaded();
+    /* A page that could not be loaded. It is shown empty, must not be
+     * changed and is written back exactly as it was read (only to a
+     * file of the same format). */
+    bool isDamaged() const { return damaged; }
+    /* for unloaded pages that are known not to load, see ensureLoaded */
+    void setDamaged() { damaged = true; }
+
+    /* has to be called after each change, drops the cached XML representation */
+    void invalidate() {
+        Q_ASSERT(loaded && !damaged);
+        xmlCache.clear();
+        nativeBlock.clear();
+        nativeFile.clear();
+        revision = newRevision();
+    }
+    /* unique among all pages, changes with each call to invalidate() */
+    int getRevision() const { return revision; }
+
+    bool hasXmlCache() const { return !xmlCache.isNull(); }
+    void setXmlCache(const QByteArray &xml) { xmlCache = xml; }
+    /* returns the cached representation if there is one, the null
+     * byte array for damaged pages of a native file */
     QByteArray getXmlRepresentation() const;
+
+    /* the block of the native file the page was read from, valid
+     * until the page is changed */
+    bool hasNativeBlock() const { return !nativeBlock.isNull(); }
+    QByteArray getNativeBlock() const { return nativeBlock; }
+
+private:
+    static int newRevision();
+    QByteArray buildXmlRepresentation() const;
+
+    QByteArray xmlCache;
+    QByteArray nativeBlock;
+    QSharedPointer<QFile> nativeFile;
+    bool loaded;
+    bool damaged;
+    int revision;
 };
 
 class EraserContext
 {
 public:
     EraserContext() {}
+    /* Erases everything of the stroke that touches the eraser of the
+     * given width moved along path (a circle if path is a single point).
+     * The segments are cut exactly where the ink of the stroke meets the
+     * area swept by the eraser. Appends the remaining parts to newStrokes
+     * and the erased parts to removedStrokes, returns false (and appends
+     * nothing) if nothing was erased. */
     bool erase(const ScribbleStroke *stroke, QList<ScribbleStroke> *removedStrokes, QList<ScribbleStroke> *newStrokes,
-               const QPointF &point, qreal width);
+               const QPolygonF &path, qreal width);
 
 private:
-    void appendFromPreviousChangeIndexUpTo(int endIndex, QList<ScribbleStroke> *list);
-    void eraseEnded();
-
-    bool previousPointRemoved;
-    int previousChangeIndex;
+    /* computes the sorted, disjoint parts of the segment a-b that are
+     * erased into intervals, returns false if there are none */
+    bool clipSegment(qreal ax, qreal ay, qreal bx, qreal by, const QPolygonF &path, qreal radius);
 
-    const ScribbleStroke *stroke;
-    QList<ScribbleStroke> *removedStrokes;
-    QList<ScribbleStroke> *newStrokes;
+    static void appendPoint(QVector<float> &xs, QVector<float> &ys, qreal x, qreal y) {
+        xs.append(x);
+        ys.append(y);
+    }
+    /* appends the points as a stroke with the pen of stroke (if there
+     * are at least two) and clears them */
+    static void finishPart(const ScribbleStroke *stroke, QVector<float> &xs, QVector<float> &ys,
+                           QList<ScribbleStroke> *list);
+
+    QVector<quint8> hits;
+    QVector<quint8> pathHits;
+    QVector<QPair<qreal, qreal> > intervals;
+    QVector<float> keptX, keptY;
+    QVector<float> erasedX, erasedY;
 };
 
 class XournalXMLHandler : public QXmlDefaultHandler {
@@ -153,6 +336,7 @@ private:
     QList<ScribblePage> pages;
 
     QString currentLocalName;
+    ScribbleStroke currentStroke;
     QByteArray currentStrokeString;
 
     QHash<QString, QColor> xournal_colors;
@@ -170,21 +354,105 @@ public:
     QPen pen;
 };
 
+/* Receives the XML of each page that had no XML cache as soon as the
+ * page is written, see ScribbleDocument::writeXournalFile. */
+class ScribbleXmlFragmentReceiver
+{
+public:
+    virtual ~ScribbleXmlFragmentReceiver() {}
+    virtual void xmlFragmentComputed(int page, int revision, const QByteArray &xml) = 0;
+};
+
 class ScribbleDocument : public QObject
 {
     Q_OBJECT
 public:
     explicit ScribbleDocument(QObject *parent = 0);
-    bool loadXournalFile(QByteArray data);
+    ~ScribbleDocument();
+    enum JournalResult {
+        JOURNAL_APPLIED,
+        /* only the records before a damaged one were applied */
+        JOURNAL_PARTLY_APPLIED,
+        /* missing or belongs to another version of the document */
+        JOURNAL_NOT_APPLIED
+    };
+    /* the journal (see ScribbleJournal) is applied if it belongs to data,
+     * journalResult is set accordingly */
+    bool loadXournalFile(QByteArray data, const QByteArray &journal = QByteArray(), JournalResult *journalResult = 0);
+    /* Loads a file in the native format (see NativeFormat). The file is
+     * mapped into memory and, depending on the load mode, the pages are
+     * only read from it when they are needed. */
+    bool loadNativeFile(const QString &fileName);
+    /* the file is written next to the old one and then replaces it, so
+     * pages that still refer to a mapping of the old one stay valid */
+    bool writeNativeFile(const QString &fileName);
+    /* Loads copies of the pages that are not loaded yet in the background
+     * and emits pagesDamaged for the ones that cannot be loaded. Damaged
+     * pages that are loaded already are reported right away. */
+    void checkPages();
+
+    enum LoadMode {
+        /* parse everything while loading */
+        LOAD_ALL_PAGES,
+        /* only find the pages while loading, parse them when needed */
+        LOAD_PAGES_LAZILY,
+        /* find the pages, then parse them concurrently on the global
+         * thread pool, same result as LOAD_ALL_PAGES */
+        LOAD_PAGES_IN_PARALLEL
+    };
+    void setLoadMode(LoadMode mode) { loadMode = mode; }
+    /* strokes are simplified with this tolerance (see
+     * ScribbleStroke::simplify) when they are completed, 0 to keep all
+     * points */
+    void setSimplificationTolerance(qreal tolerance) { simplificationTolerance = tolerance; }
+    /* Simplifies all strokes of the document (loading all pages), the
+     * number of points before and after is stored if requested. Meant
+     * for batch processing (see scribble-tool), it cannot be undone
+     * and clears the undo history. */
+    void simplifyAllStrokes(qreal tolerance, int *pointsBefore = 0, int *pointsAfter = 0);
+    /* also fills the XML caches of the pages */
     QByteArray toXournalXMLFormat();
-    static QByteArray toXournalXMLFormat(const QList<ScribblePage> &pages);
+    /* if newFragments is given, it receives the XML representation of
+     * all pages that did not have a cached one (null for the others),
+     * with parallel the pages are formatted concurrently on the global
+     * thread pool, the output is the same, null if a page cannot be
+     * written (see ScribblePage::getXmlRepresentation) */
+    static QByteArray toXournalXMLFormat(const QList<ScribblePage> &pages, QVector<QByteArray> *newFragments = 0,
+                                         bool parallel = false);
+    /* Writes the document page by page to a gzip file and fills the XML
+     * caches. checksum receives the CRC-32 of the uncompressed data. */
+    bool writeXournalFile(const QFile &file, int compressionLevel, int compressionThreads, quint32 *checksum);
+    /* as above for a copy of the pages, the new XML of each page is
+     * handed to receiver (if any) right after it is written and not
+     * kept, parallel formats a few pages ahead */
+    static bool writeXournalFile(const QList<ScribblePage> &pages, GZFileWriter &writer,
+                                 ScribbleXmlFragmentReceiver *receiver = 0, bool parallel = false);
     /* TODO this will cause deep copies to occur upon the first
-     * change (i.e. first mouse move) */
-    QList<ScribblePage> getPagesCopy() const { return pages; }
+     * change (i.e. first mouse move)
+     * A stroke that is still being drawn is not part of the copy, it
+     * is journaled only once it is completed. */
+    QList<ScribblePage> getPagesCopy() const;
+    /* the changes since the last call as journal records */
+    QByteArray takeJournalRecords();
+    /* the same without removing them */
+    const QByteArray &getJournalRecords() const { return journalRecords; }
 
     int getNumPages() const { return pages.length(); }
+    const ScribblePage &getPage(int index) const { return pages[index]; }
     const ScribblePage &getCurrentPage() const { return pages[currentPage]; }
+    int getCurrentPageIndex() const { return currentPage; }
     int getCurrentLayer() const { return currentLayer; }
+    /* the layer that is shown when switching from layer to the (loaded)
+     * page, the topmost one if layer was the topmost one before */
+    static int layerOnPage(const ScribblePage &page, int layer, bool topLayer) {
+        return topLayer ? page.layers.length() - 1 : qMin(layer, page.layers.length() - 1);
+    }
+
+    /* the memory used by the undo steps (see ScribbleHistory) */
+    void setHistoryLimit(int bytes);
+    bool canUndo() const;
+    bool canRedo() const;
+
     bool hasChangedSinceLastSave() const { return changedSinceLastSave; }
     void setSaved() { changedSinceLastSave = false; }
 
@@ -192,12 +460,15 @@ signals:
     void pageOrLayerNumberChanged(int currentPage, int maxPages, int currentLayer, int maxLayers);
     /* only if changed completely */
     void pageOrLayerChanged(const ScribblePage &page, int currentLayer);
-    /* Only the last point was added. The stroke is the newest one. */
-    void strokePointAdded(const ScribbleStroke &);
+    /* Only the last count points were added. The stroke is the newest one. */
+    void strokePointsAdded(const ScribbleStroke &, int count);
     /* Is emitted after all points have been added. */
     void strokeCompleted(const ScribbleStroke &);
 
     void strokesChanged(const ScribblePage &page, int layer, const QList<ScribbleStroke> &removedStrokes);
+    /* the pages could not be loaded, they are shown empty and cannot be
+     * changed (see ScribblePage::isDamaged) */
+    void pagesDamaged(const QList<int> &pages);
 
 public slots:
     void usePen() { endCurrentStroke(); stylus.mode = stylus.PEN; stylus.pen.setWidth(2); }
@@ -214,15 +485,44 @@ public slots:
     void layerDown();
 
     void touchEventDataReceived(const QPoint &pos, int pressure);
+    /* several samples at once, all with pressure (or all lifted) */
+    void touchEventDataReceived(const QPolygon &positions, int pressure);
 
     void setViewSize(const QSize &size) { currentViewSize = size; }
+
+    /* stores an XML representation of a page that was computed elsewhere
+     * (e.g. during an asynchronous save) if the page did not change since */
+    void setPageXmlCache(int page, int revision, const QByteArray &xml);
+
+    /* reverts the last stroke, eraser movement, new page or new layer */
+    void undo();
+    void redo();
+
+private slots:
+    /* erases along the eraser samples received since the last call */
+    void flushEraser();
+    void pageCheckFinished();
+
 private:
+    static bool parsePagesInParallel(const QByteArray &data, QString *title, QList<ScribblePage> *pages);
     void initAfterLoad();
     void endCurrentStroke();
-    void eraseAt(const QPointF &point);
+    void eraseAlong(const QPolygonF &path);
+    /* the samples from..to-1, all inside of the view */
+    void handleTouchSamples(const QPolygon &positions, int from, int to, int pressure);
+    /* applies a change of an undo step, which is journaled but not
+     * recorded in the history again */
+    void replaceStrokes(int page, int layer, int index, int count, const QList<ScribbleStroke> &strokes);
+    void removeLastPage();
+    void removeLastLayer(int page);
+    /* shows the changes of an undo step, strokes are the ones that
+     * changed on page and layer, which is -1 if it was removed */
+    void showUndoneChanges(int page, int layer, bool structureChanged, const QList<ScribbleStroke> &strokes);
 
     QString title;
     QList<ScribblePage> pages;
+    LoadMode loadMode;
+    qreal simplificationTolerance;
 
     int currentPage;
     int currentLayer;
@@ -232,10 +532,20 @@ private:
 
     Stylus stylus;
 
-    /* shortcut to last item of current layer (if it exists) */
-    ScribbleStroke *currentStroke;
+    /* index of the stroke that is being drawn in the current layer or -1 */
+    int currentStroke;
+
+    /* Eraser samples are collected and erased together in flushEraser,
+     * which is scheduled once new samples arrive. The first point is the
+     * last one of the previous batch so that the path is continuous. */
+    QPolygonF eraserPath;
+    bool eraserPending;
 
     bool changedSinceLastSave;
+    QByteArray journalRecords;
+    ScribbleHistory *history;
+    /* index and revision of the damaged pages, see checkPages */
+    QFutureWatcher<QList<QPair<int, int> > > pageCheck;
 };
 
 
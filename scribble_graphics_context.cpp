@@ -0,0 +1,203 @@
+/*
+ * scribble: Scribbling Application for Onyx Boox M92
+ *
+ * Copyright (C) 2012 peter-x
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "scribble_graphics_context.h"
+
+#include <QPen>
+#include <QtCore/qmath.h>
+
+#include <algorithm>
+
+#include "span_rasterizer.h"
+
+void ScribbleGraphicsContext::drawPage(const ScribblePage &page, int maxLayer)
+{
+    for (int li = 0; li <= maxLayer; li ++) {
+        const ScribbleLayer &l = page.layers[li];
+        foreach (const ScribbleStroke &s, l.getStrokes()) {
+            drawStroke(s);
+        }
+    }
+}
+
+void ScribbleGraphicsContext::drawPageRegion(const ScribblePage &page, int maxLayer, const QRegion &region)
+{
+    QRect bounds = region.boundingRect();
+    for (int li = 0; li <= maxLayer; li ++) {
+        const ScribbleLayer &l = page.layers[li];
+        foreach (int j, l.strokesNear(bounds)) {
+            const ScribbleStroke &s = l.getStroke(j);
+            for (int i = 0; i + 1 < s.getNumPoints(); i ++) {
+                if (region.intersects(segmentRect(s, i)))
+                    drawStrokeSegment(s, i);
+            }
+        }
+    }
+}
+
+void ScribbleGraphicsContext::drawStroke(const ScribbleStroke &stroke)
+{
+    QPen pen = stroke.getPen();
+    unsigned char color = undraw ? 0xff : 0x00; //pen.color().lightness();
+    /* TODO can we draw in different levels of gray? */
+
+    int n = stroke.getNumPoints();
+    if (image) {
+        for (int i = 0; i + 1 < n; i ++) {
+            drawLineSpans(stroke.getPoint(i), stroke.getPoint(i + 1), color, pen.widthF());
+        }
+    } else if (painter) {
+        for (int i = 0; i + 1 < n; i ++) {
+            drawLinePainter(stroke.getPoint(i).toPoint(), stroke.getPoint(i + 1).toPoint(), color, qCeil(pen.widthF()));
+        }
+    } else {
+        /* TODO check if drawing multiple lines works */
+        for (int i = 0; i + 1 < n; i ++) {
+            drawLineDirect(stroke.getPoint(i).toPoint(), stroke.getPoint(i + 1).toPoint(), color, qCeil(pen.widthF()));
+        }
+    }
+}
+
+void ScribbleGraphicsContext::drawStrokeSegment(const ScribbleStroke &stroke, int i)
+{
+    QPen pen = stroke.getPen();
+    unsigned char color = undraw ? 0xff : 0x00; //pen.color().lightness();
+    /* TODO can we draw in different levels of gray? */
+    if (image) {
+        drawLineSpans(stroke.getPoint(i), stroke.getPoint(i + 1), color, pen.widthF());
+        return;
+    }
+    QPoint p1 = stroke.getPoint(i).toPoint();
+    QPoint p2 = stroke.getPoint(i + 1).toPoint();
+    if (painter) {
+        drawLinePainter(p1, p2, color, qCeil(pen.widthF()));
+    } else {
+        drawLineDirect(p1, p2, color, qCeil(pen.widthF()));
+    }
+}
+
+void ScribbleGraphicsContext::drawStrokeSegments(const ScribbleStroke &stroke, int from, int to)
+{
+    if (painter || image) {
+        for (int i = from; i < to; i ++)
+            drawStrokeSegment(stroke, i);
+        return;
+    }
+    if (to <= from)
+        return;
+
+    /* one call to the screen for the whole polyline */
+    QVector<QPoint> line;
+    for (int i = from; i <= to; i ++)
+        line.append(stroke.getPoint(i).toPoint());
+    unsigned char color = undraw ? 0xff : 0x00;
+    drawLines(line, color, qCeil(stroke.getPenWidth()));
+}
+
+QRect ScribbleGraphicsContext::segmentRect(const ScribbleStroke &stroke, int i)
+{
+    /* the points are rounded and the line width is rounded up */
+    qreal width = stroke.getPen().widthF();
+    QPointF p1 = stroke.getPoint(i);
+    QPointF p2 = stroke.getPoint(i + 1);
+    return QRect(QPoint(qFloor(qMin(p1.x(), p2.x()) - width / 2.0) - 1,
+                        qFloor(qMin(p1.y(), p2.y()) - width / 2.0) - 1),
+                 QSize(qCeil(qAbs(p1.x() - p2.x()) + width) + 4,
+                       qCeil(qAbs(p1.y() - p2.y()) + width) + 4));
+}
+
+void ScribbleGraphicsContext::drawLinePainter(const QPoint &p1, const QPoint &p2, unsigned char color, int width)
+{
+    QBrush brush(QColor(color, color, color), Qt::SolidPattern);
+
+    int rad = width / 2;
+    int px1 = p1.x() - rad;
+    int py1 = p1.y() - rad;
+    int px2 = p2.x() - rad;
+    int py2 = p2.y() - rad;
+
+    painter->setRenderHint(QPainter::Antialiasing);
+    painter->fillRect(px2, py2, width, width, brush);
+
+    bool is_steep = qAbs(py2 - py1) > qAbs(px2 - px1);
+    if (is_steep) {
+        std::swap(px1, py1);
+        std::swap(px2, py2);
+    }
+
+    // setup line draw
+    int deltax   = qAbs(px2 - px1);
+    int deltaerr = qAbs(py2 - py1);
+    int error = 0;
+    int x = px1;
+    int y = py1;
+
+    // setup step increment
+    int xstep = (px1 < px2) ? 1 : -1;
+    int ystep = (py1 < py2) ? 1 : -1;
+
+    if (is_steep) {
+        for (int numpix = 0; numpix < deltax; numpix++) {
+            x += xstep;
+            error += deltaerr;
+
+            if (2 * error > deltax) {
+                y += ystep;
+                error -= deltax;
+            }
+
+            painter->fillRect(y, x, width, width, brush);
+        }
+    } else {
+        for (int numpix = 0; numpix < deltax; numpix++) {
+            x += xstep;
+            error += deltaerr;
+
+            if (2 * error > deltax) {
+                y += ystep;
+                error -= deltax;
+            }
+
+            painter->fillRect(x, y, width, width, brush);
+        }
+    }
+
+}
+
+void ScribbleGraphicsContext::drawLineSpans(const QPointF &p1, const QPointF &p2, unsigned char color, qreal width)
+{
+    foreach (const QRect &r, clip.rects()) {
+        SpanRasterizer::drawSegment(image, r.translated(-origin), p1.x() - origin.x(), p1.y() - origin.y(),
+                                    p2.x() - origin.x(), p2.y() - origin.y(), width, color);
+    }
+}
+
+void ScribbleGraphicsContext::drawLineDirect(const QPoint &p1, const QPoint &p2, unsigned char color, int width)
+{
+    QVector<QPoint> line;
+    line.append(p1);
+    line.append(p2);
+    drawLines(line, color, width);
+}
+
+void ScribbleGraphicsContext::drawLines(const QVector<QPoint> &, unsigned char, int)
+{
+    /* there is no screen to draw to */
+}
@@ -0,0 +1,75 @@
+/*
+ * scribble: Scribbling Application for Onyx Boox M92
+ *
+ * Copyright (C) 2012 peter-x
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SCRIBBLE_GRAPHICS_CONTEXT_H
+#define SCRIBBLE_GRAPHICS_CONTEXT_H
+
+#include <QImage>
+#include <QPainter>
+#include <QPoint>
+#include <QRect>
+#include <QRegion>
+#include <QVector>
+
+#include "scribble_document.h"
+
+class ScribbleGraphicsContext
+{
+public:
+    /* draw to QWidget */
+    ScribbleGraphicsContext(QPainter *painter, bool undraw) : painter(painter), image(0), undraw(undraw) {}
+    /* draw into the pixels of a Format_Mono or Format_Indexed8 image (see
+     * SpanRasterizer) that shows the page from origin, only inside of clip */
+    ScribbleGraphicsContext(QImage *image, const QPoint &origin, const QRegion &clip, bool undraw) :
+        painter(0), image(image), origin(origin), clip(clip), undraw(undraw) {}
+    virtual ~ScribbleGraphicsContext() {}
+
+    void drawPage(const ScribblePage &page, int maxLayer);
+    /* draws all segments of the layers up to maxLayer that reach into
+     * region, does not clip them */
+    void drawPageRegion(const ScribblePage &page, int maxLayer, const QRegion &region);
+    void drawStroke(const ScribbleStroke &stroke);
+    void drawStrokeSegment(const ScribbleStroke &stroke, int i);
+    /* the segments from..to-1, as a single polyline when drawing to screen */
+    void drawStrokeSegments(const ScribbleStroke &stroke, int from, int to);
+
+    /* the pixels that can be touched when drawing segment i */
+    static QRect segmentRect(const ScribbleStroke &stroke, int i);
+
+protected:
+    /* for subclasses that draw directly to a screen, see drawLines() */
+    explicit ScribbleGraphicsContext(bool undraw) : painter(0), image(0), undraw(undraw) {}
+    /* Draws the polyline through the points (in page coordinates)
+     * directly, used if there is neither a painter nor an image. */
+    virtual void drawLines(const QVector<QPoint> &points, unsigned char color, int width);
+
+private:
+    void drawLinePainter(const QPoint &p1, const QPoint &p2, unsigned char color, int width);
+    void drawLineDirect(const QPoint &p1, const QPoint &p2, unsigned char color, int width);
+    void drawLineSpans(const QPointF &p1, const QPointF &p2, unsigned char color, qreal width);
+
+    QPainter *painter;
+    QImage *image;
+    QPoint origin;
+    QRegion clip;
+    bool undraw;
+};
+
+#endif // SCRIBBLE_GRAPHICS_CONTEXT_H
@@ -0,0 +1,254 @@
+/*
+ * scribble: Scribbling Application for Onyx Boox M92
+ *
+ * Copyright (C) 2012 peter-x
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "scribble_history.h"
+
+#include <QSet>
+
+#include <limits>
+
+/* bytes needed by a stroke in addition to its points */
+static const int strokeOverhead = 32;
+/* operations in the open step before it is compacted */
+static const int compactionThreshold = 64;
+
+ScribbleHistory::ScribbleHistory(int maxBytes) :
+    openSteps(0), discardingStep(false), maxBytes(maxBytes), usedBytes(0), openBytes(0),
+    compactAt(compactionThreshold)
+{
+}
+
+void ScribbleHistory::setMaxBytes(int bytes)
+{
+    maxBytes = bytes;
+    evict();
+}
+
+void ScribbleHistory::clear()
+{
+    undoSteps.clear();
+    redoSteps.clear();
+    openStep.clear();
+    openSteps = 0;
+    discardingStep = false;
+    usedBytes = 0;
+    openBytes = 0;
+    compactAt = compactionThreshold;
+}
+
+void ScribbleHistory::beginStep()
+{
+    if (openSteps ++ > 0)
+        return;
+    openStep.clear();
+    openBytes = 0;
+    discardingStep = false;
+    compactAt = compactionThreshold;
+}
+
+void ScribbleHistory::endStep()
+{
+    Q_ASSERT(openSteps > 0);
+    if (-- openSteps > 0)
+        return;
+    if (!discardingStep && !openStep.isEmpty()) {
+        undoSteps.append(openStep);
+        usedBytes += openBytes;
+    }
+    openStep.clear();
+    openBytes = 0;
+    discardingStep = false;
+}
+
+void ScribbleHistory::strokesReplaced(int page, int layer, int index, const QList<ScribbleStroke> &oldStrokes,
+                                      const QList<ScribbleStroke> &newStrokes, const ScribbleLayer &changedLayer)
+{
+    Operation op;
+    op.type = Operation::STROKES_REPLACED;
+    op.page = page;
+    op.layer = layer;
+    op.index = index;
+    op.tail = changedLayer.getNumStrokes() - index - newStrokes.length();
+    op.oldStrokes = oldStrokes;
+    op.newStrokes = newStrokes;
+
+    beginStep();
+    record(op);
+    if (!discardingStep && openStep.length() >= compactAt)
+        compactOpenStep(changedLayer, page, layer);
+    endStep();
+}
+
+void ScribbleHistory::pageAdded(const QSizeF &size)
+{
+    Operation op;
+    op.type = Operation::PAGE_ADDED;
+    op.page = op.layer = op.index = op.tail = 0;
+    op.size = size;
+
+    beginStep();
+    record(op);
+    endStep();
+}
+
+void ScribbleHistory::layerAdded(int page)
+{
+    Operation op;
+    op.type = Operation::LAYER_ADDED;
+    op.page = page;
+    op.layer = op.index = op.tail = 0;
+
+    beginStep();
+    record(op);
+    endStep();
+}
+
+bool ScribbleHistory::undo(Step *step)
+{
+    if (!canUndo())
+        return false;
+    *step = undoSteps.takeLast();
+    redoSteps.append(*step);
+    return true;
+}
+
+bool ScribbleHistory::redo(Step *step)
+{
+    if (!canRedo())
+        return false;
+    *step = redoSteps.takeLast();
+    undoSteps.append(*step);
+    return true;
+}
+
+void ScribbleHistory::record(const Operation &op)
+{
+    /* the steps that were undone cannot be redone after a new change */
+    for (int i = 0; i < redoSteps.length(); i ++)
+        usedBytes -= cost(redoSteps[i]);
+    redoSteps.clear();
+
+    if (discardingStep)
+        return;
+    openStep.append(op);
+    openBytes += cost(op);
+    evict();
+}
+
+void ScribbleHistory::compactOpenStep(const ScribbleLayer &changedLayer, int page, int layer)
+{
+    int lo = std::numeric_limits<int>::max();
+    int tail = std::numeric_limits<int>::max();
+    for (int i = 0; i < openStep.length(); i ++) {
+        const Operation &op = openStep[i];
+        if (op.type != Operation::STROKES_REPLACED || op.page != page || op.layer != layer) {
+            /* only steps that change a single layer are compacted, do
+             * not look at this step again too soon */
+            compactAt = 2 * openStep.length();
+            return;
+        }
+        lo = qMin(lo, op.index);
+        tail = qMin(tail, op.tail);
+    }
+
+    /* the strokes before lo and the last tail strokes were not changed
+     * by any of the operations, the range in between is reverted to
+     * before the step by undoing the operations */
+    int hi = changedLayer.getNumStrokes() - tail;
+    Operation merged;
+    merged.type = Operation::STROKES_REPLACED;
+    merged.page = page;
+    merged.layer = layer;
+    merged.index = lo;
+    merged.tail = tail;
+    merged.newStrokes = changedLayer.getStrokes().mid(lo, hi - lo);
+
+    QList<ScribbleStroke> strokes = merged.newStrokes;
+    for (int i = openStep.length() - 1; i >= 0; i --) {
+        const Operation &op = openStep[i];
+        int at = op.index - lo;
+        QList<ScribbleStroke> before = strokes.mid(0, at);
+        before += op.oldStrokes;
+        before += strokes.mid(at + op.newStrokes.length());
+        strokes = before;
+    }
+    merged.oldStrokes = strokes;
+
+    openStep.clear();
+    openStep.append(merged);
+    openBytes = cost(merged);
+    compactAt = compactionThreshold;
+}
+
+void ScribbleHistory::evict()
+{
+    while (usedBytes + openBytes > maxBytes && !(undoSteps.isEmpty() && redoSteps.isEmpty())) {
+        if (!undoSteps.isEmpty())
+            usedBytes -= cost(undoSteps.takeFirst());
+        else
+            usedBytes -= cost(redoSteps.takeFirst());
+    }
+    if (openBytes > maxBytes) {
+        /* Nothing before the step can be undone without it. The rest of
+         * the step is ignored. */
+        openStep.clear();
+        openBytes = 0;
+        discardingStep = true;
+    }
+}
+
+QList<ScribbleStroke> ScribbleHistory::changedStrokes(const Operation &op)
+{
+    /* strokes that are on both sides share their points */
+    QSet<const float *> oldPoints;
+    for (int i = 0; i < op.oldStrokes.length(); i ++)
+        oldPoints.insert(op.oldStrokes[i].getXData());
+    QSet<const float *> newPoints;
+    for (int i = 0; i < op.newStrokes.length(); i ++)
+        newPoints.insert(op.newStrokes[i].getXData());
+
+    QList<ScribbleStroke> strokes;
+    for (int i = 0; i < op.oldStrokes.length(); i ++) {
+        if (!newPoints.contains(op.oldStrokes[i].getXData()))
+            strokes.append(op.oldStrokes[i]);
+    }
+    for (int i = 0; i < op.newStrokes.length(); i ++) {
+        if (!oldPoints.contains(op.newStrokes[i].getXData()))
+            strokes.append(op.newStrokes[i]);
+    }
+    return strokes;
+}
+
+int ScribbleHistory::cost(const Operation &op)
+{
+    QList<ScribbleStroke> strokes = changedStrokes(op);
+    int bytes = strokeOverhead;
+    for (int i = 0; i < strokes.length(); i ++)
+        bytes += strokeOverhead + 2 * sizeof(float) * strokes[i].getNumPoints();
+    return bytes;
+}
+
+int ScribbleHistory::cost(const Step &step)
+{
+    int bytes = 0;
+    for (int i = 0; i < step.length(); i ++)
+        bytes += cost(step[i]);
+    return bytes;
+}
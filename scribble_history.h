@@ -0,0 +1,110 @@
+/*
+ * scribble: Scribbling Application for Onyx Boox M92
+ *
+ * Copyright (C) 2012 peter-x
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SCRIBBLE_HISTORY_H
+#define SCRIBBLE_HISTORY_H
+
+#include <QList>
+#include <QSizeF>
+
+#include "scribble_document.h"
+
+/* Undo and redo log of a document. It stores the changes themselves
+ * (the strokes that were replaced and their replacements), not copies
+ * of the pages. All changes between beginStep() and endStep() (e.g. a
+ * whole movement of the eraser) are undone together.
+ * The oldest steps are dropped once the stored strokes need more than
+ * the memory limit. */
+class ScribbleHistory
+{
+public:
+    struct Operation {
+        enum Type {
+            STROKES_REPLACED, PAGE_ADDED, LAYER_ADDED
+        } type;
+        int page;
+        int layer;
+        /* the strokes oldStrokes starting at index were replaced by
+         * newStrokes, the layer ended with tail unchanged strokes */
+        int index;
+        int tail;
+        QList<ScribbleStroke> oldStrokes;
+        QList<ScribbleStroke> newStrokes;
+        QSizeF size;
+    };
+    /* the operations in the order they were done */
+    typedef QList<Operation> Step;
+
+    explicit ScribbleHistory(int maxBytes = 4 * 1024 * 1024);
+
+    void setMaxBytes(int bytes);
+    void clear();
+
+    /* steps can be nested, the outermost one counts */
+    void beginStep();
+    void endStep();
+
+    /* the change was already made to the layer */
+    void strokesReplaced(int page, int layer, int index, const QList<ScribbleStroke> &oldStrokes,
+                         const QList<ScribbleStroke> &newStrokes, const ScribbleLayer &changedLayer);
+    void pageAdded(const QSizeF &size);
+    void layerAdded(int page);
+
+    bool canUndo() const { return !undoSteps.isEmpty() && openSteps == 0; }
+    bool canRedo() const { return !redoSteps.isEmpty() && openSteps == 0; }
+    /* Moves the last step to the redo steps and returns it, its
+     * operations have to be reverted in reverse order. */
+    bool undo(Step *step);
+    /* moves the step that was undone last back, its operations have to
+     * be done again in order */
+    bool redo(Step *step);
+
+    int bytesUsed() const { return usedBytes; }
+
+    /* the strokes of the operation that are only on one side, i.e. the
+     * ones that were really removed or added */
+    static QList<ScribbleStroke> changedStrokes(const Operation &op);
+
+private:
+    void record(const Operation &op);
+    /* merges the stroke operations of the open step per layer into one
+     * operation each, so that long steps do not grow without bounds */
+    void compactOpenStep(const ScribbleLayer &changedLayer, int page, int layer);
+    void evict();
+
+    static int cost(const Operation &op);
+    static int cost(const Step &step);
+
+    QList<Step> undoSteps;
+    /* the next step to redo is the last one */
+    QList<Step> redoSteps;
+    Step openStep;
+    int openSteps;
+    /* the open step was too large and is not recorded */
+    bool discardingStep;
+    int maxBytes;
+    /* by undoSteps and redoSteps */
+    int usedBytes;
+    int openBytes;
+    /* the open step is compacted once it has this many operations */
+    int compactAt;
+};
+
+#endif // SCRIBBLE_HISTORY_H
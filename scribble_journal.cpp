@@ -0,0 +1,237 @@
+/*
+ * scribble: Scribbling Application for Onyx Boox M92
+ *
+ * Copyright (C) 2012 peter-x
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "scribble_journal.h"
+
+#include <QDataStream>
+#include <QVector>
+
+#include <cstring>
+
+static const quint32 journalMagic = 0x53434a4c; /* "SCJL" */
+static const quint16 journalVersion = 1;
+
+/* floats are stored bitwise, independent of the QDataStream version */
+static void writeFloat(QDataStream &stream, float value)
+{
+    quint32 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    stream << bits;
+}
+
+static float readFloat(QDataStream &stream)
+{
+    quint32 bits = 0;
+    stream >> bits;
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+QByteArray ScribbleJournal::header(quint32 documentChecksum)
+{
+    QByteArray header;
+    QDataStream stream(&header, QIODevice::WriteOnly);
+    stream << journalMagic << journalVersion << documentChecksum;
+    return header;
+}
+
+void ScribbleJournal::appendPageAdded(QByteArray &journal, const QSizeF &size)
+{
+    QByteArray record;
+    QDataStream stream(&record, QIODevice::WriteOnly);
+    stream << quint8(PAGE_ADDED) << double(size.width()) << double(size.height());
+    appendRecord(journal, record);
+}
+
+void ScribbleJournal::appendLayerAdded(QByteArray &journal, int page)
+{
+    QByteArray record;
+    QDataStream stream(&record, QIODevice::WriteOnly);
+    stream << quint8(LAYER_ADDED) << qint32(page);
+    appendRecord(journal, record);
+}
+
+void ScribbleJournal::appendPageRemoved(QByteArray &journal)
+{
+    QByteArray record;
+    QDataStream stream(&record, QIODevice::WriteOnly);
+    stream << quint8(PAGE_REMOVED);
+    appendRecord(journal, record);
+}
+
+void ScribbleJournal::appendLayerRemoved(QByteArray &journal, int page)
+{
+    QByteArray record;
+    QDataStream stream(&record, QIODevice::WriteOnly);
+    stream << quint8(LAYER_REMOVED) << qint32(page);
+    appendRecord(journal, record);
+}
+
+void ScribbleJournal::appendStrokesReplaced(QByteArray &journal, int page, int layer, int index, int count,
+                                            const QList<ScribbleStroke> &strokes)
+{
+    QByteArray record;
+    QDataStream stream(&record, QIODevice::WriteOnly);
+    stream << quint8(STROKES_REPLACED) << qint32(page) << qint32(layer)
+           << qint32(index) << qint32(count) << quint32(strokes.length());
+    foreach (const ScribbleStroke &stroke, strokes) {
+        QPen pen = stroke.getPen();
+        int n = stroke.getNumPoints();
+        stream << quint32(pen.color().rgba()) << double(pen.widthF()) << quint32(n);
+        const float *x = stroke.getXData();
+        const float *y = stroke.getYData();
+        for (int i = 0; i < n; i ++) {
+            writeFloat(stream, x[i]);
+            writeFloat(stream, y[i]);
+        }
+    }
+    appendRecord(journal, record);
+}
+
+void ScribbleJournal::appendRecord(QByteArray &journal, const QByteArray &record)
+{
+    QByteArray length;
+    QDataStream stream(&length, QIODevice::WriteOnly);
+    stream << quint32(record.size());
+    journal += length;
+    journal += record;
+}
+
+bool ScribbleJournal::replay(const QByteArray &journal, quint32 documentChecksum, QList<ScribblePage> &pages,
+                             bool *complete)
+{
+    if (complete != 0)
+        *complete = false;
+    QDataStream stream(journal);
+    quint32 magic = 0;
+    quint16 version = 0;
+    quint32 checksum = 0;
+    stream >> magic >> version >> checksum;
+    if (stream.status() != QDataStream::Ok || magic != journalMagic ||
+            version != journalVersion || checksum != documentChecksum)
+        return false;
+
+    while (!stream.atEnd()) {
+        quint32 length = 0;
+        stream >> length;
+        qint64 remaining = journal.size() - stream.device()->pos();
+        if (stream.status() != QDataStream::Ok || qint64(length) > remaining) {
+            /* last record was not written completely */
+            break;
+        }
+        QByteArray record(length, 0);
+        stream.readRawData(record.data(), length);
+        /* the records before stay applied, a record is either applied
+         * completely or not at all */
+        if (!replayRecord(record, pages))
+            return true;
+    }
+    if (complete != 0)
+        *complete = true;
+    return true;
+}
+
+bool ScribbleJournal::replayRecord(const QByteArray &record, QList<ScribblePage> &pages)
+{
+    QDataStream stream(record);
+    quint8 type = 0;
+    stream >> type;
+
+    if (type == PAGE_ADDED) {
+        double width = 0, height = 0;
+        stream >> width >> height;
+        if (stream.status() != QDataStream::Ok)
+            return false;
+        ScribblePage p;
+        p.size = QSizeF(width, height);
+        p.layers.append(ScribbleLayer());
+        pages.append(p);
+    } else if (type == LAYER_ADDED) {
+        qint32 page = -1;
+        stream >> page;
+        if (stream.status() != QDataStream::Ok || page < 0 || page >= pages.length())
+            return false;
+        /* damaged pages must not be changed */
+        if (!pages[page].ensureLoaded())
+            return false;
+        pages[page].layers.append(ScribbleLayer());
+        pages[page].invalidate();
+    } else if (type == PAGE_REMOVED) {
+        /* a document always keeps one page */
+        if (pages.length() <= 1)
+            return false;
+        pages.removeLast();
+    } else if (type == LAYER_REMOVED) {
+        qint32 page = -1;
+        stream >> page;
+        if (stream.status() != QDataStream::Ok || page < 0 || page >= pages.length())
+            return false;
+        if (!pages[page].ensureLoaded())
+            return false;
+        if (pages[page].layers.length() <= 1)
+            return false;
+        pages[page].layers.removeLast();
+        pages[page].invalidate();
+    } else if (type == STROKES_REPLACED) {
+        qint32 page = -1, layer = -1, index = -1, count = -1;
+        quint32 numStrokes = 0;
+        stream >> page >> layer >> index >> count >> numStrokes;
+        if (page < 0 || page >= pages.length())
+            return false;
+        ScribblePage &p = pages[page];
+        if (!p.ensureLoaded())
+            return false;
+        if (layer < 0 || layer >= p.layers.length())
+            return false;
+        ScribbleLayer &l = p.layers[layer];
+        if (index < 0 || count < 0 || index + count > l.getNumStrokes())
+            return false;
+
+        QList<ScribbleStroke> strokes;
+        for (quint32 i = 0; i < numStrokes && stream.status() == QDataStream::Ok; i ++) {
+            quint32 color = 0, numPoints = 0;
+            double width = 0;
+            stream >> color >> width >> numPoints;
+            if (qint64(numPoints) * 8 > record.size())
+                return false;
+            QVector<float> x(numPoints);
+            QVector<float> y(numPoints);
+            for (quint32 j = 0; j < numPoints; j ++) {
+                x[j] = readFloat(stream);
+                y[j] = readFloat(stream);
+            }
+            QPen pen;
+            pen.setColor(QColor::fromRgba(color));
+            pen.setWidthF(width);
+            ScribbleStroke stroke;
+            stroke.setPen(pen);
+            stroke.appendPoints(x.constData(), y.constData(), numPoints);
+            strokes.append(stroke);
+        }
+        if (stream.status() != QDataStream::Ok)
+            return false;
+        l.replaceStrokes(index, count, strokes);
+        p.invalidate();
+    } else {
+        return false;
+    }
+    return true;
+}
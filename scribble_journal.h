@@ -0,0 +1,80 @@
+/*
+ * scribble: Scribbling Application for Onyx Boox M92
+ *
+ * Copyright (C) 2012 peter-x
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SCRIBBLE_JOURNAL_H
+#define SCRIBBLE_JOURNAL_H
+
+#include <QByteArray>
+#include <QList>
+#include <QSizeF>
+#include <QString>
+
+#include "scribble_document.h"
+
+/* Append-only log of the changes made to a document since it was last
+ * written completely. It is stored next to the document file and
+ * starts with a header containing the checksum of the uncompressed
+ * document it applies to, so a journal that belongs to an older version
+ * of the document is recognized and ignored.
+ *
+ * Every record is prefixed with its length, a truncated last record
+ * (e.g. after a crash during an append) is ignored. */
+class ScribbleJournal
+{
+public:
+    static QString fileName(const QString &documentFileName) { return documentFileName + ".journal"; }
+
+    static QByteArray header(quint32 documentChecksum);
+
+    /* a page with one layer was appended */
+    static void appendPageAdded(QByteArray &journal, const QSizeF &size);
+    /* a layer was appended to the page */
+    static void appendLayerAdded(QByteArray &journal, int page);
+    /* the last page was removed (undoing an added page) */
+    static void appendPageRemoved(QByteArray &journal);
+    /* the last layer of the page was removed (undoing an added layer) */
+    static void appendLayerRemoved(QByteArray &journal, int page);
+    /* count strokes starting at index were replaced by strokes,
+     * covers adding, erasing and splitting of strokes */
+    static void appendStrokesReplaced(QByteArray &journal, int page, int layer, int index, int count,
+                                      const QList<ScribbleStroke> &strokes);
+
+    /* Applies the journal to the pages. Returns false and leaves the
+     * pages untouched if the journal does not belong to the document
+     * with the given checksum. A damaged record stops the replay, the
+     * records before it stay applied and complete is set to false. */
+    static bool replay(const QByteArray &journal, quint32 documentChecksum, QList<ScribblePage> &pages,
+                       bool *complete = 0);
+
+private:
+    enum RecordType {
+        PAGE_ADDED = 1,
+        LAYER_ADDED = 2,
+        STROKES_REPLACED = 3,
+        PAGE_REMOVED = 4,
+        LAYER_REMOVED = 5
+    };
+
+    static void appendRecord(QByteArray &journal, const QByteArray &record);
+    /* applies the record completely or not at all */
+    static bool replayRecord(const QByteArray &record, QList<ScribblePage> &pages);
+};
+
+#endif // SCRIBBLE_JOURNAL_H
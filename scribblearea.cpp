@@ -23,124 +23,41 @@
 #include <QPainter>
 #include <QPen>
 #include <QMouseEvent>
+#include <QtConcurrentRun>
 
 #include "onyx/screen/screen_proxy.h"
 #include "onyx/screen/screen_update_watcher.h"
 
-void ScribbleGraphicsContext::drawPage(const ScribblePage &page, int maxLayer)
-{
-    for (int li = 0; li <= maxLayer; li ++) {
-        const ScribbleLayer &l = page.layers[li];
-        foreach (const ScribbleStroke &s, l.items) {
-            drawStroke(s);
-        }
-    }
-}
-
-void ScribbleGraphicsContext::drawStroke(const ScribbleStroke &stroke)
-{
-    QPen pen = stroke.getPen();
-    unsigned char color = undraw ? 0xff : 0x00; //pen.color().lightness();
-    /* TODO can we draw in different levels of gray? */
-
-    const QPolygonF &points = stroke.getPoints();
-    if (painter) {
-        for (int i = 0; i + 1 < points.size(); i ++) {
-            drawLinePainter(points[i].toPoint(), points[i + 1].toPoint(), color, qCeil(pen.widthF()));
-        }
-    } else {
-        /* TODO check if drawing multiple lines works */
-        for (int i = 0; i + 1 < points.size(); i ++) {
-            drawLineDirect(points[i].toPoint(), points[i + 1].toPoint(), color, qCeil(pen.widthF()));
-        }
-    }
-}
-
-void ScribbleGraphicsContext::drawStrokeSegment(const ScribbleStroke &stroke, int i)
-{
-    QPen pen = stroke.getPen();
-    unsigned char color = undraw ? 0xff : 0x00; //pen.color().lightness();
-    /* TODO can we draw in different levels of gray? */
-    const QPolygonF &points = stroke.getPoints();
-    if (painter) {
-        drawLinePainter(points[i].toPoint(), points[i + 1].toPoint(), color, qCeil(pen.widthF()));
-    } else {
-        drawLineDirect(points[i].toPoint(), points[i + 1].toPoint(), color, qCeil(pen.widthF()));
-    }
-}
-
-void ScribbleGraphicsContext::drawLinePainter(const QPoint &p1, const QPoint &p2, unsigned char color, int width)
-{
-    QBrush brush(QColor(color, color, color), Qt::SolidPattern);
-
-    int rad = width / 2;
-    int px1 = p1.x() - rad;
-    int py1 = p1.y() - rad;
-    int px2 = p2.x() - rad;
-    int py2 = p2.y() - rad;
-
-    painter->setRenderHint(QPainter::Antialiasing);
-    painter->fillRect(px2, py2, width, width, brush);
-
-    bool is_steep = qAbs(py2 - py1) > qAbs(px2 - px1);
-    if (is_steep) {
-        std::swap(px1, py1);
-        std::swap(px2, py2);
-    }
-
-    // setup line draw
-    int deltax   = qAbs(px2 - px1);
-    int deltaerr = qAbs(py2 - py1);
-    int error = 0;
-    int x = px1;
-    int y = py1;
-
-    // setup step increment
-    int xstep = (px1 < px2) ? 1 : -1;
-    int ystep = (py1 < py2) ? 1 : -1;
-
-    if (is_steep) {
-        for (int numpix = 0; numpix < deltax; numpix++) {
-            x += xstep;
-            error += deltaerr;
-
-            if (2 * error > deltax) {
-                y += ystep;
-                error -= deltax;
-            }
-
-            painter->fillRect(y, x, width, width, brush);
-        }
-    } else {
-        for (int numpix = 0; numpix < deltax; numpix++) {
-            x += xstep;
-            error += deltaerr;
-
-            if (2 * error > deltax) {
-                y += ystep;
-                error -= deltax;
-            }
-
-            painter->fillRect(x, y, width, width, brush);
-        }
-    }
-
-}
-
-void ScribbleGraphicsContext::drawLineDirect(const QPoint &p1, const QPoint &p2, unsigned char color, int width)
+void OnyxGraphicsContext::drawLines(const QVector<QPoint> &points, unsigned char color, int width)
 {
     QVector<QPoint> line;
-    line.append(widget->mapToGlobal(p1));
-    line.append(widget->mapToGlobal(p2));
+    foreach (const QPoint &p, points)
+        line.append(widget->mapToGlobal(p));
     /* TODO try if intermediate colors work */
     color = color >= 0x7f ? 0xff : 0x00;
     /* TODO width smller than two does not work */
     if (width < 2) width = 2;
-    onyx::screen::instance().drawLines(line.data(), 2, color, width);
+    onyx::screen::instance().drawLines(line.data(), line.size(), color, width);
+}
+
+/* about 14 pages of the size of the screen of the M92 */
+static const int pageCacheBytes = 2 * 1024 * 1024;
+
+static PrerenderedPage prerenderPage(ScribblePage page, int layer, bool topLayer, const QSize &size)
+{
+    /* only this copy is loaded, the revision stays the same */
+    page.ensureLoaded();
+    PrerenderedPage result;
+    result.revision = page.getRevision();
+    result.layer = ScribbleDocument::layerOnPage(page, layer, topLayer);
+    result.tiles.resize(size);
+    result.tiles.render(page, result.layer);
+    return result;
 }
 
 ScribbleArea::ScribbleArea(QWidget *parent, const ScribbleDocument *document) :
-    QWidget(parent, Qt::FramelessWindowHint), document(document)
+    QWidget(parent, Qt::FramelessWindowHint), document(document), pageCache(pageCacheBytes),
+    prerenderLayer(-1), prerenderTopLayer(false)
 {
     setMinimumSize(100, 100);
     setAutoFillBackground(false);
@@ -149,17 +66,22 @@ ScribbleArea::ScribbleArea(QWidget *parent, const ScribbleDocument *document) :
 #ifdef BUILD_FOR_ARM
     onyx::screen::watcher().addWatcher(this);
 #endif
-    buffer = QImage(size(), QImage::Format_Mono); /* TODO this is BW and not monochrome */
-    QPainter painter(&buffer);
-    painter.eraseRect(rect());
+    tilesRevision = -1;
+    tilesLayer = -1;
+    tiles.resize(size());
 
     regionToUpdate = QRegion(rect());
     updateTimer.setInterval(80);
     connect(&updateTimer, SIGNAL(timeout()), SLOT(updateIfNeeded()));
     updateTimer.start();
 
+    prerenderTimer.setInterval(500);
+    prerenderTimer.setSingleShot(true);
+    connect(&prerenderTimer, SIGNAL(timeout()), SLOT(prerenderNeighbours()));
+    connect(&prerenderWatcher, SIGNAL(finished()), SLOT(prerenderFinished()));
+
     connect(document, SIGNAL(pageOrLayerChanged(ScribblePage,int)), SLOT(redrawPage(ScribblePage,int)));
-    connect(document, SIGNAL(strokePointAdded(ScribbleStroke)), SLOT(drawLastStrokeSegment(ScribbleStroke)));
+    connect(document, SIGNAL(strokePointsAdded(ScribbleStroke,int)), SLOT(drawNewStrokeSegments(ScribbleStroke,int)));
     connect(document, SIGNAL(strokeCompleted(ScribbleStroke)), SLOT(drawCompletedStroke(ScribbleStroke)));
     connect(document, SIGNAL(strokesChanged(ScribblePage,int,QList<ScribbleStroke>)), SLOT(updateStrokes(ScribblePage,int,QList<ScribbleStroke>)));
 }
@@ -167,50 +89,59 @@ ScribbleArea::ScribbleArea(QWidget *parent, const ScribbleDocument *document) :
 void ScribbleArea::resizeEvent(QResizeEvent *ev)
 {
     emit resized(ev->size());
+    tiles.resize(size());
     redrawPage(document->getCurrentPage(), document->getCurrentLayer());
+    regionToUpdate = rect();
 }
 
 void ScribbleArea::redrawPage(const ScribblePage &page, int layer)
 {
-    buffer = QImage(size(), QImage::Format_Mono);
-    QPainter painter(&buffer);
-    painter.eraseRect(rect());
-
-    ScribbleGraphicsContext ctx(&painter, false);
-    ctx.drawPage(page, layer);
+    if (page.getRevision() != tilesRevision) {
+        /* another page (or a page that changed completely), the page that
+         * was shown could be needed again soon */
+        if (tilesRevision >= 0)
+            pageCache.insert(tilesRevision, tilesLayer, tiles);
+        if (!pageCache.take(page.getRevision(), layer, &tiles))
+            tiles = TileCache();
+        tiles.resize(size());
+        regionToUpdate = rect();
+    } else {
+        /* only the visible layers changed */
+        for (int li = qMin(layer, tilesLayer) + 1; li <= qMax(layer, tilesLayer); li ++) {
+            foreach (const ScribbleStroke &s, page.layers[li].getStrokes())
+                tiles.invalidate(ScribbleStrokeIndex::strokeRect(s).toAlignedRect().adjusted(-2, -2, 2, 2));
+        }
+    }
+    tilesRevision = page.getRevision();
+    tilesLayer = layer;
 
-    regionToUpdate = rect();
+    regionToUpdate += tiles.render(page, layer);
+    prerenderTimer.start();
 }
 
-void ScribbleArea::drawLastStrokeSegment(const ScribbleStroke &s)
+void ScribbleArea::drawNewStrokeSegments(const ScribbleStroke &s, int count)
 {
-    int n = s.getPoints().size();
+    int n = s.getNumPoints();
+    tilesRevision = document->getCurrentPage().getRevision();
+    prerenderTimer.start();
     if (n < 2) return;
+    /* the first new point also completes the segment from the point before */
+    int from = qMax(0, n - 1 - count);
 
+    tiles.drawStrokeSegments(s, from, n - 1);
 #if defined(BUILD_FOR_ARM)
-    ScribbleGraphicsContext ctx(this, false);
+    OnyxGraphicsContext ctx(this, false);
+    ctx.drawStrokeSegments(s, from, n - 1);
 #else
-    QPainter painter(&buffer);
-    ScribbleGraphicsContext ctx(&painter, false);
-#endif
-
-    ctx.drawStrokeSegment(s, n - 2);
-
-#if !defined(BUILD_FOR_ARM)
-    qreal width = s.getPen().widthF();
-    QPointF p1 = s.getPoints()[n - 2];
-    QPointF p2 = s.getPoints()[n - 1];
-    QRect br(QPoint(qFloor(qMin(p1.x(), p2.x()) - width / 2.0) - 1,
-                    qFloor(qMin(p1.y(), p2.y()) - width / 2.0) - 1),
-             QSize(qCeil(qAbs(p1.x() - p2.x()) + width) + 2,
-                   qCeil(qAbs(p1.y() - p2.y()) + width) + 2));
-
-    regionToUpdate += br;
+    for (int i = from; i < n - 1; i ++)
+        regionToUpdate += ScribbleGraphicsContext::segmentRect(s, i);
 #endif
 }
 
-void ScribbleArea::drawCompletedStroke(const ScribbleStroke &)
+void ScribbleArea::drawCompletedStroke(const ScribbleStroke &s)
 {
+    /* a single point is only completed to a segment here */
+    drawNewStrokeSegments(s, 1);
     /* TODO here we could redraw it nicely */
 }
 
@@ -218,42 +149,73 @@ void ScribbleArea::updateStrokes(const ScribblePage &page, int layer, const QLis
 {
     /* this will not work if there is a background or if there are strokes of different colors */
 
-    /* repaint all removed strokes white */
+    /* the pixels that were covered by the removed ink */
+    QRegion damage;
+    foreach (const ScribbleStroke &s, removedStrokes) {
+        for (int i = 0; i + 1 < s.getNumPoints(); i ++)
+            damage += ScribbleGraphicsContext::segmentRect(s, i);
+    }
+    tilesRevision = page.getRevision();
+    prerenderTimer.start();
+    if (damage.isEmpty())
+        return;
+
+    tiles.repair(page, layer, damage);
+
 #if defined(BUILD_FOR_ARM)
-    ScribbleGraphicsContext ctx(this, true);
+    /* Drawing directly to the screen cannot be clipped, so the removed
+     * strokes are painted white and the segments crossing them are
+     * redrawn completely. This only repaints ink that is there anyway. */
+    OnyxGraphicsContext undrawCtx(this, true);
+    foreach (const ScribbleStroke &s, removedStrokes)
+        undrawCtx.drawStroke(s);
+    OnyxGraphicsContext ctx(this, false);
+    ctx.drawPageRegion(page, layer, damage);
 #else
-    QPainter painter(&buffer);
-    ScribbleGraphicsContext ctx(&painter, true);
-#endif
-    foreach (const ScribbleStroke &s, removedStrokes) {
-        ctx.drawStroke(s);
-#if !defined(BUILD_FOR_ARM)
-        /* TODO round in the right direction */
-        regionToUpdate += s.getBoundingRect().toRect();
+    regionToUpdate += damage;
 #endif
-    }
+}
 
-#if 0
+void ScribbleArea::prerenderNeighbours()
+{
+    if (prerenderWatcher.isRunning())
+        return;
+
+    int layer = document->getCurrentLayer();
+    bool topLayer = layer == document->getCurrentPage().layers.length() - 1;
+    if (layer != prerenderLayer || topLayer != prerenderTopLayer) {
+        prerenderedRevisions.clear();
+        prerenderLayer = layer;
+        prerenderTopLayer = topLayer;
+    }
 
-    /* find all strokes intersecting with the removed strokes and repaint them */
-    /* perhaps first use a combined bounding rect for all removed strokes? */
-    for (int i = 0; i <= layer; i ++) {
-        const ScribbleLayer &l = page.layers[i];
-        for (int j = 0; j < l.items.length(); j ++) {
-            const ScribbleStroke &s = l.items[j];
-            for (int k = 0; k < removedStrokes.length(); k ++) {
-                const ScribbleStroke &sr = removedStrokes[k];
-                /* TODO we only need to redraw intersecting line segments */
-                if (s.boundingRectIntersects(sr)) {
-                    for (int p = 0; p < s.getPoints().size() - 1; p ++) {
-                        if (s.segmentIntersects(p, sr))
-                            drawStrokeSegment(s, p);
-                    }
-                }
-            }
+    int current = document->getCurrentPageIndex();
+    const int neighbours[] = {current + 1, current - 1};
+    for (int k = 0; k < 2; k ++) {
+        int index = neighbours[k];
+        if (index < 0 || index >= document->getNumPages())
+            continue;
+        const ScribblePage &page = document->getPage(index);
+        if (page.isLoaded()) {
+            if (pageCache.contains(page.getRevision(), ScribbleDocument::layerOnPage(page, layer, topLayer)))
+                continue;
+        } else if (prerenderedRevisions.contains(page.getRevision())) {
+            continue;
         }
+        prerenderedRevisions.insert(page.getRevision());
+        prerenderWatcher.setFuture(QtConcurrent::run(prerenderPage, page, layer, topLayer, size()));
+        return;
     }
-#endif
+}
+
+void ScribbleArea::prerenderFinished()
+{
+    PrerenderedPage p = prerenderWatcher.result();
+    if (p.revision != tilesRevision)
+        pageCache.insert(p.revision, p.layer, p.tiles);
+    /* continue with the other neighbour if the pen is still idle */
+    if (!prerenderTimer.isActive())
+        prerenderNeighbours();
 }
 
 void ScribbleArea::updateIfNeeded()
@@ -266,7 +228,7 @@ void ScribbleArea::updateIfNeeded()
 void ScribbleArea::paintEvent(QPaintEvent *ev)
 {
     QPainter bufferPainter(this);
-    bufferPainter.drawImage(QPoint(), buffer);
+    tiles.paint(&bufferPainter, ev->rect());
     regionToUpdate = QRect();
 #if defined(BUILD_FOR_ARM)
     /* TODO we could safely request to update the whole rect */
@@ -24,28 +24,32 @@
 #include <QWidget>
 #include <QPainter>
 #include <QTimer>
+#include <QFutureWatcher>
+#include <QSet>
 
 #include "scribble_document.h"
+#include "scribble_graphics_context.h"
+#include "tile_cache.h"
 
-class ScribbleGraphicsContext
+/* draws directly to the screen of the device */
+class OnyxGraphicsContext : public ScribbleGraphicsContext
 {
 public:
-    /* draw to QWidget */
-    ScribbleGraphicsContext(QPainter *painter, bool undraw) : widget(0), painter(painter), undraw(undraw) {}
-    /* directly draw to screen */
-    ScribbleGraphicsContext(QWidget *widget, bool undraw) : widget(widget), painter(0), undraw(undraw) {}
+    OnyxGraphicsContext(QWidget *widget, bool undraw) : ScribbleGraphicsContext(undraw), widget(widget) {}
 
-    void drawPage(const ScribblePage &page, int maxLayer);
-    void drawStroke(const ScribbleStroke &stroke);
-    void drawStrokeSegment(const ScribbleStroke &stroke, int i);
+protected:
+    void drawLines(const QVector<QPoint> &points, unsigned char color, int width);
 
 private:
-    void drawLinePainter(const QPoint &p1, const QPoint &p2, unsigned char color, int width);
-    void drawLineDirect(const QPoint &p1, const QPoint &p2, unsigned char color, int width);
-
     QWidget *widget;
-    QPainter *painter;
-    bool undraw;
+};
+
+/* a page rendered in the background */
+struct PrerenderedPage
+{
+    int revision;
+    int layer;
+    TileCache tiles;
 };
 
 class ScribbleArea : public QWidget
@@ -60,7 +64,8 @@ signals:
 
 public slots:
     void redrawPage(const ScribblePage &page, int layer);
-    void drawLastStrokeSegment(const ScribbleStroke &);
+    /* draws the segments to the last count points */
+    void drawNewStrokeSegments(const ScribbleStroke &, int count);
     void drawCompletedStroke(const ScribbleStroke &);
 
     void updateStrokes(const ScribblePage &page, int layer, const QList<ScribbleStroke> &removedStrokes);
@@ -70,6 +75,10 @@ protected:
 
 private slots:
     void updateIfNeeded();
+    /* renders the next or the previous page in the background if they
+     * are not in the cache */
+    void prerenderNeighbours();
+    void prerenderFinished();
 
 private:
     void paintEvent(QPaintEvent *);
@@ -80,7 +89,22 @@ private:
 
     const ScribbleDocument *document;
 
-    QImage buffer;
+    TileCache tiles;
+    /* the revision of the page and the layer the tiles show, strokes
+     * that are drawn or erased are added to the tiles directly */
+    int tilesRevision;
+    int tilesLayer;
+
+    /* pages that were shown or rendered in the background */
+    PageCache pageCache;
+    /* started by any drawing, the neighbours are rendered once it runs out */
+    QTimer prerenderTimer;
+    QFutureWatcher<PrerenderedPage> prerenderWatcher;
+    /* revisions of the unloaded pages that were rendered for
+     * prerenderLayer and prerenderTopLayer */
+    QSet<int> prerenderedRevisions;
+    int prerenderLayer;
+    bool prerenderTopLayer;
 
     QRegion regionToUpdate;
     QTimer updateTimer;
@@ -0,0 +1,136 @@
+/*
+ * scribble: Scribbling Application for Onyx Boox M92
+ *
+ * Copyright (C) 2012 peter-x
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "span_rasterizer.h"
+
+#include <cmath>
+#include <cstring>
+
+/* Restricts [*x0, *x1] to the x with lo <= f0 + f1 x <= hi, returns
+ * false if nothing remains. */
+static bool clipLinear(qreal f0, qreal f1, qreal lo, qreal hi, qreal *x0, qreal *x1)
+{
+    if (f1 == 0)
+        return lo <= f0 && f0 <= hi;
+    qreal s0 = (lo - f0) / f1;
+    qreal s1 = (hi - f0) / f1;
+    if (f1 < 0)
+        qSwap(s0, s1);
+    *x0 = qMax(*x0, s0);
+    *x1 = qMin(*x1, s1);
+    return *x0 <= *x1;
+}
+
+/* extends [*x0, *x1] (empty if *x0 > *x1) by the part of the scanline y
+ * inside the circle */
+static void addCircleSpan(qreal cx, qreal cy, qreal r, qreal y, qreal *x0, qreal *x1)
+{
+    qreal dy = y - cy;
+    qreal d = r * r - dy * dy;
+    if (d < 0)
+        return;
+    d = std::sqrt(d);
+    *x0 = qMin(*x0, cx - d);
+    *x1 = qMax(*x1, cx + d);
+}
+
+void SpanRasterizer::drawSegment(QImage *image, const QRect &clip, qreal ax, qreal ay, qreal bx, qreal by,
+                                 qreal width, uchar gray)
+{
+    /* at least about one pixel, so that thin lines have no gaps */
+    qreal r = qMax(width / 2, qreal(0.75));
+    QRect area = clip & image->rect();
+    if (area.isEmpty())
+        return;
+
+    qreal dx = bx - ax, dy = by - ay;
+    qreal length = std::sqrt(dx * dx + dy * dy);
+    qreal ux = 0, uy = 0;
+    if (length > 0) {
+        ux = dx / length;
+        uy = dy / length;
+    }
+
+    /* pixels are hit at their centers */
+    int yBegin = qMax(area.top(), int(std::ceil(qMin(ay, by) - r - 0.5)));
+    int yEnd = qMin(area.bottom(), int(std::floor(qMax(ay, by) + r - 0.5)));
+    int depth = image->depth();
+    for (int y = yBegin; y <= yEnd; y ++) {
+        qreal yc = y + 0.5;
+        /* The capsule is the union of the circles around the end points
+         * and the rectangle between them, all of them convex, so the
+         * pixels on this scanline form a single span. */
+        qreal x0 = 1e30, x1 = -1e30;
+        addCircleSpan(ax, ay, r, yc, &x0, &x1);
+        addCircleSpan(bx, by, r, yc, &x0, &x1);
+        if (length > 0) {
+            qreal s0 = -1e30, s1 = 1e30;
+            /* 0 <= (p - a).u <= length and |(p - a) x u| <= r */
+            if (clipLinear((yc - ay) * uy - ax * ux, ux, 0, length, &s0, &s1) &&
+                    clipLinear(-(yc - ay) * ux - ax * uy, uy, -r, r, &s0, &s1)) {
+                x0 = qMin(x0, s0);
+                x1 = qMax(x1, s1);
+            }
+        }
+        if (x0 > x1)
+            continue;
+        x0 = qMax(x0, qreal(area.left()));
+        x1 = qMin(x1, qreal(area.right() + 1));
+        if (x0 > x1)
+            continue;
+        int px0 = int(std::ceil(x0 - 0.5));
+        int px1 = int(std::floor(x1 - 0.5));
+        if (px0 <= px1)
+            fillSpan(image->scanLine(y), depth, px0, px1, gray);
+    }
+}
+
+void SpanRasterizer::fillRect(QImage *image, const QRect &rect, uchar gray)
+{
+    QRect area = rect & image->rect();
+    if (area.isEmpty())
+        return;
+    int depth = image->depth();
+    for (int y = area.top(); y <= area.bottom(); y ++)
+        fillSpan(image->scanLine(y), depth, area.left(), area.right(), gray);
+}
+
+void SpanRasterizer::fillSpan(uchar *line, int depth, int x0, int x1, uchar gray)
+{
+    if (depth == 8) {
+        memset(line + x0, gray, x1 - x0 + 1);
+        return;
+    }
+
+    /* Format_Mono: the most significant bit is the leftmost pixel, the
+     * bytes in between the partial ones at the ends are set at once */
+    uchar value = gray >= 0x80 ? 0xff : 0x00;
+    int byte0 = x0 >> 3, byte1 = x1 >> 3;
+    uchar mask0 = 0xff >> (x0 & 7);
+    uchar mask1 = 0xff << (7 - (x1 & 7));
+    if (byte0 == byte1) {
+        uchar mask = mask0 & mask1;
+        line[byte0] = (line[byte0] & ~mask) | (value & mask);
+        return;
+    }
+    line[byte0] = (line[byte0] & ~mask0) | (value & mask0);
+    memset(line + byte0 + 1, value, byte1 - byte0 - 1);
+    line[byte1] = (line[byte1] & ~mask1) | (value & mask1);
+}
@@ -0,0 +1,46 @@
+/*
+ * scribble: Scribbling Application for Onyx Boox M92
+ *
+ * Copyright (C) 2012 peter-x
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SPAN_RASTERIZER_H
+#define SPAN_RASTERIZER_H
+
+#include <QImage>
+#include <QRect>
+
+/* Draws into the pixels of Format_Mono and Format_Indexed8 images
+ * directly, one horizontal span per scanline. Mono images have to use
+ * index 0 for black and 1 for white (as QImage does by default), 8 bit
+ * images a gray scale color table, i.e. the index is the gray value. */
+class SpanRasterizer
+{
+public:
+    /* Draws the segment from a to b with round caps, i.e. all pixels
+     * whose centers are at most width / 2 away from it, but only inside
+     * of clip. Coordinates are pixels of the image. */
+    static void drawSegment(QImage *image, const QRect &clip, qreal ax, qreal ay, qreal bx, qreal by,
+                            qreal width, uchar gray);
+    static void fillRect(QImage *image, const QRect &rect, uchar gray);
+
+private:
+    /* fills the pixels x0 to x1 (inclusive) of the scanline */
+    static void fillSpan(uchar *line, int depth, int x0, int x1, uchar gray);
+};
+
+#endif // SPAN_RASTERIZER_H
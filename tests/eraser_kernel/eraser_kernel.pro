@@ -0,0 +1,11 @@
+# Compares the vectorized eraser kernel with the scalar code and measures
+# its throughput (./tst_eraser_kernel -iterations 100 for stable numbers)
+
+TEMPLATE = app
+TARGET = tst_eraser_kernel
+CONFIG += console qtestlib
+CONFIG -= app_bundle
+
+include(../../core.pri)
+
+SOURCES += tst_eraser_kernel.cpp
@@ -0,0 +1,258 @@
+/*
+ * scribble: Scribbling Application for Onyx Boox M92
+ *
+ * Copyright (C) 2012 peter-x
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <QtTest/QtTest>
+#include <QVector>
+
+#include <cmath>
+
+#include "eraser_kernel.h"
+
+/* The vectorized kernel handles four segments at a time and leaves the
+ * rest to the scalar code, so a polyline of two points always takes the
+ * scalar path and serves as the reference.
+ * Both paths use the same float operations, but the compiler may still
+ * contract them differently, so results that differ are only accepted
+ * if the exact distance is within a tiny margin of the radius. */
+
+class TestEraserKernel : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void segmentsNearPoint();
+    void segmentsNearSegment();
+    void singlePoint();
+    void clipSegmentToCapsule();
+
+    void benchmarkSegmentsNearPoint();
+    void benchmarkSegmentsNearSegment();
+
+private:
+    static double pointSegmentDistance(double px, double py, double ax, double ay, double bx, double by);
+    static double segmentSegmentDistance(double ax, double ay, double bx, double by,
+                                         double cx, double cy, double dx, double dy);
+    static bool borderline(double distance, double radius) {
+        return std::fabs(distance - radius) <= 1e-4 * (1 + radius);
+    }
+    static float random(float min, float max) {
+        return min + (max - min) * (qrand() / float(RAND_MAX));
+    }
+    /* a random polyline, with some repeated points (segments of length 0) */
+    static void randomPolyline(int n, QVector<float> &x, QVector<float> &y);
+
+    QVector<float> benchX, benchY;
+    QVector<quint8> benchHits;
+};
+
+double TestEraserKernel::pointSegmentDistance(double px, double py, double ax, double ay, double bx, double by)
+{
+    double dx = bx - ax, dy = by - ay;
+    double dd = dx * dx + dy * dy;
+    double t = dd == 0 ? 0 : ((px - ax) * dx + (py - ay) * dy) / dd;
+    t = qBound(0.0, t, 1.0);
+    double ex = ax + t * dx - px, ey = ay + t * dy - py;
+    return std::sqrt(ex * ex + ey * ey);
+}
+
+double TestEraserKernel::segmentSegmentDistance(double ax, double ay, double bx, double by,
+                                                double cx, double cy, double dx, double dy)
+{
+    double o1 = (bx - ax) * (cy - ay) - (by - ay) * (cx - ax);
+    double o2 = (bx - ax) * (dy - ay) - (by - ay) * (dx - ax);
+    double o3 = (dx - cx) * (ay - cy) - (dy - cy) * (ax - cx);
+    double o4 = (dx - cx) * (by - cy) - (dy - cy) * (bx - cx);
+    if (((o1 < 0 && o2 > 0) || (o1 > 0 && o2 < 0)) && ((o3 < 0 && o4 > 0) || (o3 > 0 && o4 < 0)))
+        return 0;
+    return qMin(qMin(pointSegmentDistance(ax, ay, cx, cy, dx, dy), pointSegmentDistance(bx, by, cx, cy, dx, dy)),
+                qMin(pointSegmentDistance(cx, cy, ax, ay, bx, by), pointSegmentDistance(dx, dy, ax, ay, bx, by)));
+}
+
+void TestEraserKernel::randomPolyline(int n, QVector<float> &x, QVector<float> &y)
+{
+    x.resize(n);
+    y.resize(n);
+    for (int i = 0; i < n; i ++) {
+        if (i > 0 && qrand() % 8 == 0) {
+            x[i] = x[i - 1];
+            y[i] = y[i - 1];
+        } else {
+            x[i] = random(0, 100);
+            y[i] = random(0, 100);
+        }
+    }
+}
+
+void TestEraserKernel::initTestCase()
+{
+    qsrand(4711);
+
+    /* a long stroke that wanders over a page */
+    int n = 100000;
+    benchX.resize(n);
+    benchY.resize(n);
+    benchHits.resize(n);
+    float px = 300, py = 400;
+    for (int i = 0; i < n; i ++) {
+        px = qBound(0.0f, px + random(-3, 3), 600.0f);
+        py = qBound(0.0f, py + random(-3, 3), 800.0f);
+        benchX[i] = px;
+        benchY[i] = py;
+    }
+}
+
+void TestEraserKernel::segmentsNearPoint()
+{
+    QVector<float> x, y;
+    QVector<quint8> hits, reference(1);
+    for (int round = 0; round < 2000; round ++) {
+        /* lengths around the vector width test the remainder loop */
+        int n = 2 + round % 14;
+        randomPolyline(n, x, y);
+        hits.fill(0xff, n);
+        float px = random(0, 100), py = random(0, 100), radius = random(0.5, 30);
+
+        int count = EraserKernel::segmentsNearPoint(x.constData(), y.constData(), n, px, py, radius, hits.data());
+        int expectedCount = 0;
+        for (int i = 0; i < n - 1; i ++) {
+            EraserKernel::segmentsNearPoint(x.constData() + i, y.constData() + i, 2, px, py, radius,
+                                            reference.data());
+            double distance = pointSegmentDistance(px, py, x[i], y[i], x[i + 1], y[i + 1]);
+            if (!borderline(distance, radius)) {
+                QCOMPARE(int(hits[i]), int(reference[0]));
+                QCOMPARE(bool(hits[i]), distance <= radius);
+            }
+            QVERIFY(hits[i] <= 1);
+            expectedCount += hits[i];
+        }
+        QCOMPARE(count, expectedCount);
+        /* nothing is written beyond the segments */
+        QCOMPARE(int(hits[n - 1]), 0xff);
+    }
+}
+
+void TestEraserKernel::segmentsNearSegment()
+{
+    QVector<float> x, y;
+    QVector<quint8> hits, reference(1);
+    for (int round = 0; round < 2000; round ++) {
+        int n = 2 + round % 14;
+        randomPolyline(n, x, y);
+        hits.fill(0xff, n);
+        float ax = random(0, 100), ay = random(0, 100), radius = random(0.5, 10);
+        /* the eraser moves only a bit between two samples, sometimes not at all */
+        float bx = round % 5 == 0 ? ax : ax + random(-20, 20);
+        float by = round % 5 == 0 ? ay : ay + random(-20, 20);
+
+        int count = EraserKernel::segmentsNearSegment(x.constData(), y.constData(), n, ax, ay, bx, by, radius,
+                                                      hits.data());
+        int expectedCount = 0;
+        for (int i = 0; i < n - 1; i ++) {
+            EraserKernel::segmentsNearSegment(x.constData() + i, y.constData() + i, 2, ax, ay, bx, by, radius,
+                                              reference.data());
+            double distance = segmentSegmentDistance(ax, ay, bx, by, x[i], y[i], x[i + 1], y[i + 1]);
+            if (!borderline(distance, radius)) {
+                QCOMPARE(int(hits[i]), int(reference[0]));
+                QCOMPARE(bool(hits[i]), distance <= radius);
+            }
+            QVERIFY(hits[i] <= 1);
+            expectedCount += hits[i];
+        }
+        QCOMPARE(count, expectedCount);
+        QCOMPARE(int(hits[n - 1]), 0xff);
+    }
+}
+
+void TestEraserKernel::singlePoint()
+{
+    float x = 10, y = 10;
+    quint8 hit = 0xff;
+    QCOMPARE(EraserKernel::segmentsNearPoint(&x, &y, 1, 12, 10, 3, &hit), 1);
+    QCOMPARE(int(hit), 1);
+    QCOMPARE(EraserKernel::segmentsNearPoint(&x, &y, 1, 14, 10, 3, &hit), 0);
+    QCOMPARE(int(hit), 0);
+    QCOMPARE(EraserKernel::segmentsNearSegment(&x, &y, 1, 0, 12, 20, 12, 3, &hit), 1);
+    QCOMPARE(int(hit), 1);
+    QCOMPARE(EraserKernel::segmentsNearSegment(&x, &y, 1, 0, 14, 20, 14, 3, &hit), 0);
+    QCOMPARE(int(hit), 0);
+    QCOMPARE(EraserKernel::segmentsNearPoint(&x, &y, 0, 10, 10, 3, &hit), 0);
+}
+
+void TestEraserKernel::clipSegmentToCapsule()
+{
+    /* the interval found has to lie inside of the capsule, just outside
+     * of its ends the segment has to be outside */
+    for (int round = 0; round < 2000; round ++) {
+        qreal ax = random(0, 100), ay = random(0, 100), bx = random(0, 100), by = random(0, 100);
+        qreal px = random(0, 100), py = random(0, 100);
+        qreal qx = px + random(-20, 20), qy = py + random(-20, 20), radius = random(0.5, 20);
+        qreal t0, t1;
+        bool found = EraserKernel::clipSegmentToCapsule(ax, ay, bx, by, px, py, qx, qy, radius, &t0, &t1);
+        double distance = segmentSegmentDistance(px, py, qx, qy, ax, ay, bx, by);
+        if (borderline(distance, radius))
+            continue;
+        QCOMPARE(found, distance < radius);
+        if (!found)
+            continue;
+        QVERIFY(0 <= t0 && t0 < t1 && t1 <= 1);
+        for (int i = 0; i <= 10; i ++) {
+            qreal t = t0 + (t1 - t0) * i / 10;
+            double d = pointSegmentDistance(ax + t * (bx - ax), ay + t * (by - ay), px, py, qx, qy);
+            QVERIFY(d <= radius * (1 + 1e-6) + 1e-6);
+        }
+        qreal length = std::sqrt((bx - ax) * (bx - ax) + (by - ay) * (by - ay));
+        qreal step = 1e-3 / qMax(length, qreal(1e-3));
+        if (t0 - step > 0) {
+            qreal t = t0 - step;
+            QVERIFY(pointSegmentDistance(ax + t * (bx - ax), ay + t * (by - ay), px, py, qx, qy) > radius * 0.999);
+        }
+        if (t1 + step < 1) {
+            qreal t = t1 + step;
+            QVERIFY(pointSegmentDistance(ax + t * (bx - ax), ay + t * (by - ay), px, py, qx, qy) > radius * 0.999);
+        }
+    }
+}
+
+/* both benchmarks test 99999 segments per iteration */
+
+void TestEraserKernel::benchmarkSegmentsNearPoint()
+{
+    int hits = 0;
+    QBENCHMARK {
+        hits += EraserKernel::segmentsNearPoint(benchX.constData(), benchY.constData(), benchX.size(),
+                                                300, 400, 10, benchHits.data());
+    }
+    QVERIFY(hits >= 0);
+}
+
+void TestEraserKernel::benchmarkSegmentsNearSegment()
+{
+    int hits = 0;
+    QBENCHMARK {
+        hits += EraserKernel::segmentsNearSegment(benchX.constData(), benchY.constData(), benchX.size(),
+                                                  280, 390, 320, 410, 10, benchHits.data());
+    }
+    QVERIFY(hits >= 0);
+}
+
+QTEST_APPLESS_MAIN(TestEraserKernel)
+
+#include "tst_eraser_kernel.moc"
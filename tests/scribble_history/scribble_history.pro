@@ -0,0 +1,10 @@
+# Undo and redo of long eraser sessions under the memory limit
+
+TEMPLATE = app
+TARGET = tst_scribble_history
+CONFIG += console qtestlib
+CONFIG -= app_bundle
+
+include(../../core.pri)
+
+SOURCES += tst_scribble_history.cpp
@@ -0,0 +1,301 @@
+/*
+ * scribble: Scribbling Application for Onyx Boox M92
+ *
+ * Copyright (C) 2012 peter-x
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <QtTest/QtTest>
+#include <QList>
+#include <QPen>
+#include <QPolygonF>
+
+#include <cstring>
+
+#include "scribble_document.h"
+#include "scribble_history.h"
+
+/* The layers are changed like the eraser does it (a stroke is replaced
+ * by up to two pieces) and the steps the history returns are applied
+ * to them again, the strokes have to come back exactly. */
+
+class TestScribbleHistory : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void init();
+    void compactionEvery64Operations();
+    void longEraserSessions();
+    void evictionUnderLimit();
+    void oversizedStep();
+    void oversizedEraserSession();
+
+private:
+    /* the first point of each stroke is unique */
+    ScribbleStroke makeStroke(int points);
+    void addStrokes(ScribbleLayer &layer, int count, int points);
+    void addStroke(ScribbleLayer &layer, ScribbleHistory &history, int points);
+    /* replaces ops random strokes by zero to two shorter pieces */
+    void erase(ScribbleLayer &layer, ScribbleHistory &history, int ops);
+
+    static void apply(ScribbleLayer &layer, const ScribbleHistory::Step &step, bool undo);
+    static bool sameStrokes(const ScribbleLayer &layer, const QList<ScribbleStroke> &strokes);
+
+    int nextId;
+};
+
+void TestScribbleHistory::init()
+{
+    qsrand(4711);
+    nextId = 1;
+}
+
+ScribbleStroke TestScribbleHistory::makeStroke(int points)
+{
+    QPolygonF polygon;
+    polygon << QPointF(nextId ++, 0);
+    for (int i = 1; i < points; i ++)
+        polygon << QPointF(qrand() % 600, qrand() % 800);
+    return ScribbleStroke(QPen(Qt::black, 2), polygon);
+}
+
+void TestScribbleHistory::addStrokes(ScribbleLayer &layer, int count, int points)
+{
+    for (int i = 0; i < count; i ++)
+        layer.appendStroke(makeStroke(points));
+}
+
+void TestScribbleHistory::addStroke(ScribbleLayer &layer, ScribbleHistory &history, int points)
+{
+    QList<ScribbleStroke> strokes;
+    strokes << makeStroke(points);
+    int index = layer.getNumStrokes();
+    layer.replaceStrokes(index, 0, strokes);
+    history.strokesReplaced(0, 0, index, QList<ScribbleStroke>(), strokes, layer);
+}
+
+void TestScribbleHistory::erase(ScribbleLayer &layer, ScribbleHistory &history, int ops)
+{
+    for (int i = 0; i < ops && layer.getNumStrokes() > 0; i ++) {
+        int index = qrand() % layer.getNumStrokes();
+        QList<ScribbleStroke> oldStrokes;
+        oldStrokes << layer.getStroke(index);
+        QList<ScribbleStroke> newStrokes;
+        int pieces = qrand() % 3;
+        for (int j = 0; j < pieces; j ++)
+            newStrokes << makeStroke(qMax(3, layer.getStroke(index).getNumPoints() / 2));
+        layer.replaceStrokes(index, 1, newStrokes);
+        history.strokesReplaced(0, 0, index, oldStrokes, newStrokes, layer);
+    }
+}
+
+void TestScribbleHistory::apply(ScribbleLayer &layer, const ScribbleHistory::Step &step, bool undo)
+{
+    if (undo) {
+        for (int i = step.length() - 1; i >= 0; i --)
+            layer.replaceStrokes(step[i].index, step[i].newStrokes.length(), step[i].oldStrokes);
+    } else {
+        for (int i = 0; i < step.length(); i ++)
+            layer.replaceStrokes(step[i].index, step[i].oldStrokes.length(), step[i].newStrokes);
+    }
+}
+
+bool TestScribbleHistory::sameStrokes(const ScribbleLayer &layer, const QList<ScribbleStroke> &strokes)
+{
+    if (layer.getNumStrokes() != strokes.length())
+        return false;
+    for (int i = 0; i < strokes.length(); i ++) {
+        const ScribbleStroke &a = layer.getStroke(i);
+        const ScribbleStroke &b = strokes[i];
+        int n = a.getNumPoints();
+        if (n != b.getNumPoints() || a.getPenIndex() != b.getPenIndex() ||
+                memcmp(a.getXData(), b.getXData(), n * sizeof(float)) != 0 ||
+                memcmp(a.getYData(), b.getYData(), n * sizeof(float)) != 0)
+            return false;
+    }
+    return true;
+}
+
+void TestScribbleHistory::compactionEvery64Operations()
+{
+    /* 63 operations stay as they are, the 64th merges them into one */
+    int counts[] = {63, 64, 65, 200};
+    for (int k = 0; k < 4; k ++) {
+        ScribbleLayer layer;
+        addStrokes(layer, 300, 20);
+        ScribbleHistory history(1 << 30);
+        QList<ScribbleStroke> before = layer.getStrokes();
+
+        history.beginStep();
+        /* every operation replaces one stroke by two, none is lost */
+        for (int i = 0; i < counts[k]; i ++) {
+            int index = qrand() % layer.getNumStrokes();
+            QList<ScribbleStroke> oldStrokes, newStrokes;
+            oldStrokes << layer.getStroke(index);
+            newStrokes << makeStroke(5) << makeStroke(5);
+            layer.replaceStrokes(index, 1, newStrokes);
+            history.strokesReplaced(0, 0, index, oldStrokes, newStrokes, layer);
+        }
+        history.endStep();
+        QList<ScribbleStroke> after = layer.getStrokes();
+
+        ScribbleHistory::Step step;
+        QVERIFY(history.undo(&step));
+        int expected = counts[k] < 64 ? counts[k] : 1 + (counts[k] - 64) % 63;
+        QCOMPARE(step.length(), expected);
+        apply(layer, step, true);
+        QVERIFY(sameStrokes(layer, before));
+        QVERIFY(history.redo(&step));
+        apply(layer, step, false);
+        QVERIFY(sameStrokes(layer, after));
+    }
+}
+
+void TestScribbleHistory::longEraserSessions()
+{
+    for (int round = 0; round < 20; round ++) {
+        ScribbleLayer layer;
+        addStrokes(layer, 300, 50 + qrand() % 200);
+        ScribbleHistory history(1 << 30);
+        QList<QList<ScribbleStroke> > states;
+        states << layer.getStrokes();
+        int sessions = 1 + qrand() % 5;
+        for (int s = 0; s < sessions; s ++) {
+            history.beginStep();
+            erase(layer, history, 1 + qrand() % 2000);
+            history.endStep();
+            states << layer.getStrokes();
+        }
+
+        ScribbleHistory::Step step;
+        for (int s = sessions; s > 0; s --) {
+            QVERIFY(history.undo(&step));
+            /* compacted while the eraser moved */
+            QVERIFY(step.length() < 64);
+            apply(layer, step, true);
+            QVERIFY(sameStrokes(layer, states[s - 1]));
+        }
+        QVERIFY(!history.undo(&step));
+        for (int s = 1; s <= sessions; s ++) {
+            QVERIFY(history.redo(&step));
+            apply(layer, step, false);
+            QVERIFY(sameStrokes(layer, states[s]));
+        }
+        QVERIFY(!history.redo(&step));
+    }
+}
+
+void TestScribbleHistory::evictionUnderLimit()
+{
+    const int limit = 256 * 1024;
+    const int steps = 3000;
+    ScribbleLayer layer;
+    ScribbleHistory history(limit);
+    QList<QList<ScribbleStroke> > states;
+    states << layer.getStrokes();
+    for (int s = 0; s < steps; s ++) {
+        if (qrand() % 3 != 0) {
+            addStroke(layer, history, 100);
+        } else {
+            history.beginStep();
+            erase(layer, history, 300);
+            history.endStep();
+        }
+        states << layer.getStrokes();
+        QVERIFY(history.bytesUsed() <= limit);
+    }
+
+    /* the newest steps are kept, the oldest were dropped */
+    ScribbleHistory::Step step;
+    int undone = 0;
+    while (history.undo(&step)) {
+        undone ++;
+        apply(layer, step, true);
+        QVERIFY(sameStrokes(layer, states[steps - undone]));
+    }
+    QVERIFY(undone > 0);
+    QVERIFY(undone < steps);
+    QVERIFY(history.bytesUsed() <= limit);
+
+    for (int s = steps - undone + 1; s <= steps; s ++) {
+        QVERIFY(history.redo(&step));
+        apply(layer, step, false);
+        QVERIFY(sameStrokes(layer, states[s]));
+    }
+    QVERIFY(!history.redo(&step));
+}
+
+void TestScribbleHistory::oversizedStep()
+{
+    ScribbleLayer layer;
+    ScribbleHistory history(4096);
+    addStroke(layer, history, 10);
+    QVERIFY(history.canUndo());
+
+    /* nothing before it could be undone without it */
+    history.beginStep();
+    addStroke(layer, history, 2000);
+    history.endStep();
+    QVERIFY(!history.canUndo());
+    QVERIFY(!history.canRedo());
+    QCOMPARE(history.bytesUsed(), 0);
+
+    /* the history works again for the following steps */
+    QList<ScribbleStroke> before = layer.getStrokes();
+    addStroke(layer, history, 10);
+    QList<ScribbleStroke> after = layer.getStrokes();
+    ScribbleHistory::Step step;
+    QVERIFY(history.undo(&step));
+    apply(layer, step, true);
+    QVERIFY(sameStrokes(layer, before));
+    QVERIFY(!history.canUndo());
+    QVERIFY(history.redo(&step));
+    apply(layer, step, false);
+    QVERIFY(sameStrokes(layer, after));
+}
+
+void TestScribbleHistory::oversizedEraserSession()
+{
+    /* the removed strokes alone need more than the limit */
+    ScribbleLayer layer;
+    addStrokes(layer, 300, 200);
+    ScribbleHistory history(64 * 1024);
+    addStroke(layer, history, 10);
+    history.beginStep();
+    erase(layer, history, 2000);
+    history.endStep();
+    QVERIFY(!history.canUndo());
+    QVERIFY(history.bytesUsed() <= 64 * 1024);
+
+    /* a short session afterwards is recorded again */
+    QList<ScribbleStroke> before = layer.getStrokes();
+    history.beginStep();
+    erase(layer, history, 10);
+    history.endStep();
+    QList<ScribbleStroke> after = layer.getStrokes();
+    ScribbleHistory::Step step;
+    QVERIFY(history.undo(&step));
+    apply(layer, step, true);
+    QVERIFY(sameStrokes(layer, before));
+    QVERIFY(history.redo(&step));
+    apply(layer, step, false);
+    QVERIFY(sameStrokes(layer, after));
+}
+
+QTEST_APPLESS_MAIN(TestScribbleHistory)
+
+#include "tst_scribble_history.moc"
@@ -0,0 +1,6 @@
+# Unit tests and benchmarks of the document code (everything in core.pri),
+# build without the Onyx SDK and run the tst_* programs:
+#     qmake tests/tests.pro && make
+
+TEMPLATE = subdirs
+SUBDIRS = eraser_kernel scribble_history
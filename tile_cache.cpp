@@ -0,0 +1,194 @@
+/*
+ * scribble: Scribbling Application for Onyx Boox M92
+ *
+ * Copyright (C) 2012 peter-x
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "tile_cache.h"
+
+#include "scribble_graphics_context.h"
+#include "span_rasterizer.h"
+
+void TileCache::resize(const QSize &newSize)
+{
+    int newColumns = (newSize.width() + tileSize - 1) / tileSize;
+    int newRows = (newSize.height() + tileSize - 1) / tileSize;
+    if (newColumns != columns || newRows != rows) {
+        QVector<QImage> newImages(newColumns * newRows);
+        QVector<bool> newValid(newColumns * newRows, false);
+        for (int r = 0; r < qMin(rows, newRows); r ++) {
+            for (int c = 0; c < qMin(columns, newColumns); c ++) {
+                newImages[r * newColumns + c] = images[r * columns + c];
+                newValid[r * newColumns + c] = valid[r * columns + c];
+            }
+        }
+        images = newImages;
+        valid = newValid;
+        columns = newColumns;
+        rows = newRows;
+    }
+    size = newSize;
+}
+
+bool TileCache::tileRange(const QRect &rect, int *column0, int *row0, int *column1, int *row1) const
+{
+    QRect r = rect & QRect(0, 0, columns * tileSize, rows * tileSize);
+    if (r.isEmpty())
+        return false;
+    *column0 = r.left() / tileSize;
+    *row0 = r.top() / tileSize;
+    *column1 = r.right() / tileSize;
+    *row1 = r.bottom() / tileSize;
+    return true;
+}
+
+void TileCache::invalidate(const QRect &rect)
+{
+    int c0, r0, c1, r1;
+    if (!tileRange(rect, &c0, &r0, &c1, &r1))
+        return;
+    for (int r = r0; r <= r1; r ++) {
+        for (int c = c0; c <= c1; c ++)
+            valid[r * columns + c] = false;
+    }
+}
+
+QRegion TileCache::render(const ScribblePage &page, int maxLayer)
+{
+    QRegion rendered;
+    for (int i = 0; i < images.size(); i ++) {
+        if (valid[i])
+            continue;
+        if (images[i].isNull()) {
+            images[i] = QImage(tileSize, tileSize, QImage::Format_Mono); /* TODO this is BW and not monochrome */
+            /* the indices SpanRasterizer expects */
+            images[i].setColor(0, qRgb(0, 0, 0));
+            images[i].setColor(1, qRgb(255, 255, 255));
+        }
+        draw(i, page, maxLayer, tileRect(i));
+        valid[i] = true;
+        rendered += tileRect(i);
+    }
+    return rendered;
+}
+
+void TileCache::repair(const ScribblePage &page, int maxLayer, const QRegion &region)
+{
+    int c0, r0, c1, r1;
+    if (!tileRange(region.boundingRect(), &c0, &r0, &c1, &r1))
+        return;
+    for (int r = r0; r <= r1; r ++) {
+        for (int c = c0; c <= c1; c ++) {
+            int i = r * columns + c;
+            QRegion part = region & tileRect(i);
+            if (valid[i] && !part.isEmpty())
+                draw(i, page, maxLayer, part);
+        }
+    }
+}
+
+void TileCache::drawStrokeSegments(const ScribbleStroke &stroke, int from, int to)
+{
+    QRect bounds;
+    for (int i = from; i < to; i ++)
+        bounds |= ScribbleGraphicsContext::segmentRect(stroke, i);
+    int c0, r0, c1, r1;
+    if (!tileRange(bounds, &c0, &r0, &c1, &r1))
+        return;
+    for (int r = r0; r <= r1; r ++) {
+        for (int c = c0; c <= c1; c ++) {
+            int index = r * columns + c;
+            if (!valid[index])
+                continue;
+            QRect rect = tileRect(index);
+            ScribbleGraphicsContext ctx(&images[index], rect.topLeft(), rect, false);
+            for (int i = from; i < to; i ++) {
+                if (ScribbleGraphicsContext::segmentRect(stroke, i).intersects(rect))
+                    ctx.drawStrokeSegment(stroke, i);
+            }
+        }
+    }
+}
+
+void TileCache::paint(QPainter *painter, const QRect &rect) const
+{
+    int c0, r0, c1, r1;
+    if (!tileRange(rect, &c0, &r0, &c1, &r1))
+        return;
+    for (int r = r0; r <= r1; r ++) {
+        for (int c = c0; c <= c1; c ++) {
+            int index = r * columns + c;
+            if (!images[index].isNull())
+                painter->drawImage(tileRect(index).topLeft(), images[index]);
+        }
+    }
+}
+
+void TileCache::draw(int index, const ScribblePage &page, int maxLayer, const QRegion &region)
+{
+    QPoint origin = tileRect(index).topLeft();
+    foreach (const QRect &r, region.rects())
+        SpanRasterizer::fillRect(&images[index], r.translated(-origin), 0xff);
+
+    ScribbleGraphicsContext ctx(&images[index], origin, region, false);
+    ctx.drawPageRegion(page, maxLayer, region);
+}
+
+int TileCache::byteCount() const
+{
+    int bytes = 0;
+    foreach (const QImage &image, images)
+        bytes += image.byteCount();
+    return bytes;
+}
+
+/* --------------------------------------------------------------- */
+
+int PageCache::find(int revision, int layer) const
+{
+    for (int i = 0; i < entries.size(); i ++) {
+        if (entries[i].revision == revision && entries[i].layer == layer)
+            return i;
+    }
+    return -1;
+}
+
+void PageCache::insert(int revision, int layer, const TileCache &tiles)
+{
+    TileCache dummy;
+    take(revision, layer, &dummy);
+
+    Entry e;
+    e.revision = revision;
+    e.layer = layer;
+    e.tiles = tiles;
+    entries.prepend(e);
+    usedBytes += tiles.byteCount();
+    while (usedBytes > maxBytes && !entries.isEmpty())
+        usedBytes -= entries.takeLast().tiles.byteCount();
+}
+
+bool PageCache::take(int revision, int layer, TileCache *tiles)
+{
+    int i = find(revision, layer);
+    if (i < 0)
+        return false;
+    *tiles = entries[i].tiles;
+    usedBytes -= tiles->byteCount();
+    entries.removeAt(i);
+    return true;
+}
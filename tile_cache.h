@@ -0,0 +1,108 @@
+/*
+ * scribble: Scribbling Application for Onyx Boox M92
+ *
+ * Copyright (C) 2012 peter-x
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef TILE_CACHE_H
+#define TILE_CACHE_H
+
+#include <QImage>
+#include <QList>
+#include <QPainter>
+#include <QRegion>
+#include <QSize>
+#include <QVector>
+
+#include "scribble_document.h"
+
+/* The raster of a page, split into tiles of tileSize x tileSize pixels
+ * that are rendered independently. Only the tiles that are invalidated
+ * are drawn again by render(). */
+class TileCache
+{
+public:
+    static const int tileSize = 128;
+
+    TileCache() : columns(0), rows(0) {}
+
+    /* covers the area from (0, 0) to size, the tiles that were already
+     * there stay valid */
+    void resize(const QSize &size);
+    QSize getSize() const { return size; }
+
+    void invalidateAll() { valid.fill(false); }
+    void invalidate(const QRect &rect);
+
+    /* draws the layers up to maxLayer of the page into all tiles that are
+     * not valid, returns the area of these tiles */
+    QRegion render(const ScribblePage &page, int maxLayer);
+    /* draws the page again inside of region, only in the valid tiles,
+     * the others are drawn completely by render() */
+    void repair(const ScribblePage &page, int maxLayer, const QRegion &region);
+    /* adds the segments from..to-1 to the valid tiles */
+    void drawStrokeSegments(const ScribbleStroke &stroke, int from, int to);
+
+    void paint(QPainter *painter, const QRect &rect) const;
+
+    /* memory used by the tiles */
+    int byteCount() const;
+
+private:
+    QRect tileRect(int index) const {
+        return QRect((index % columns) * tileSize, (index / columns) * tileSize, tileSize, tileSize);
+    }
+    /* the range of tiles covering rect, false if there are none */
+    bool tileRange(const QRect &rect, int *column0, int *row0, int *column1, int *row1) const;
+    void draw(int index, const ScribblePage &page, int maxLayer, const QRegion &region);
+
+    QSize size;
+    int columns;
+    int rows;
+    QVector<QImage> images;
+    QVector<bool> valid;
+};
+
+/* The tiles of pages that are not shown, keyed by the revision of the
+ * page and the topmost layer that is drawn. The least recently used
+ * pages are dropped once the tiles need more than maxBytes. */
+class PageCache
+{
+public:
+    explicit PageCache(int maxBytes) : maxBytes(maxBytes), usedBytes(0) {}
+
+    bool contains(int revision, int layer) const { return find(revision, layer) >= 0; }
+    void insert(int revision, int layer, const TileCache &tiles);
+    /* removes the page from the cache, returns false if it is not there */
+    bool take(int revision, int layer, TileCache *tiles);
+
+private:
+    struct Entry {
+        int revision;
+        int layer;
+        TileCache tiles;
+    };
+
+    int find(int revision, int layer) const;
+
+    /* the most recently used first */
+    QList<Entry> entries;
+    int maxBytes;
+    int usedBytes;
+};
+
+#endif // TILE_CACHE_H
@@ -0,0 +1,11 @@
+# Command line tool for Xournal and native files, builds without the
+# Onyx SDK: qmake tool/scribble-tool.pro && make
+
+TEMPLATE = app
+TARGET = scribble-tool
+CONFIG += console
+CONFIG -= app_bundle
+
+include(../core.pri)
+
+SOURCES += scribble_tool.cpp
@@ -0,0 +1,371 @@
+/*
+ * scribble: Scribbling Application for Onyx Boox M92
+ *
+ * Copyright (C) 2012 peter-x
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QImage>
+#include <QPolygon>
+#include <QStringList>
+#include <QTextStream>
+#include <QThread>
+
+#include "coordinate_codec.h"
+#include "fileio.h"
+#include "native_format.h"
+#include "scribble_document.h"
+#include "scribble_graphics_context.h"
+
+/* Loads, writes, converts and renders documents without a screen, e.g.
+ * for batch processing and to measure the document code. */
+
+static QTextStream out(stdout);
+static QTextStream err(stderr);
+
+static void usage()
+{
+    err << "usage: scribble-tool COMMAND ARGUMENTS\n"
+           "  stats FILE               number of pages, layers, strokes and points\n"
+           "  load FILE                times loading FILE with each load mode\n"
+           "  save FILE OUTPUT         writes FILE again in the same format\n"
+           "  convert FILE OUTPUT      writes Xournal files in the native format and\n"
+           "                           native files as Xournal files\n"
+           "  simplify FILE OUTPUT [TOLERANCE]\n"
+           "                           removes points that move the strokes by at most\n"
+           "                           TOLERANCE (default 0.25), writes the same format\n"
+           "  render FILE PAGE OUTPUT  renders the page (starting at 1) to an image\n"
+           "                           (the format is taken from the extension)\n"
+           "  bench-erase [STROKES]    times the eraser on a page of STROKES short\n"
+           "                           strokes (default 10000)\n"
+           "  bench-parse [POINTS]     parses and formats POINTS stroke coordinates\n"
+           "                           (default 1000000), in points per second\n";
+}
+
+static bool isNativeFile(const QString &fileName)
+{
+    QFile file(fileName);
+    return file.open(QIODevice::ReadOnly) && NativeFormat::isNativeFormat(file.read(64));
+}
+
+static bool loadDocument(ScribbleDocument *document, const QString &fileName, ScribbleDocument::LoadMode mode)
+{
+    document->setLoadMode(mode);
+    if (isNativeFile(fileName))
+        return document->loadNativeFile(fileName);
+    QFile file(fileName);
+    QByteArray data = FileIO::readGZFileLocked(file);
+    return !data.isEmpty() && document->loadXournalFile(data);
+}
+
+static bool writeDocument(ScribbleDocument *document, const QString &fileName, bool native)
+{
+    if (native)
+        return document->writeNativeFile(fileName);
+    QFile file(fileName);
+    /* pages are formatted and compressed in parallel */
+    GZFileWriter writer(file, -1, QThread::idealThreadCount());
+    if (!ScribbleDocument::writeXournalFile(document->getPagesCopy(), writer, 0, true)) {
+        /* e.g. a damaged page of a native file */
+        err << "Not all pages could be written\n";
+        writer.abort();
+        return false;
+    }
+    return writer.close();
+}
+
+static int stats(const QString &fileName)
+{
+    ScribbleDocument document;
+    QElapsedTimer timer;
+    timer.start();
+    if (!loadDocument(&document, fileName, ScribbleDocument::LOAD_PAGES_IN_PARALLEL)) {
+        err << "Could not load " << fileName << "\n";
+        return 1;
+    }
+    qint64 loadTime = timer.elapsed();
+
+    int layers = 0, strokes = 0;
+    qint64 points = 0;
+    for (int i = 0; i < document.getNumPages(); i ++) {
+        const ScribblePage &page = document.getPage(i);
+        layers += page.layers.length();
+        foreach (const ScribbleLayer &layer, page.layers) {
+            strokes += layer.getNumStrokes();
+            foreach (const ScribbleStroke &stroke, layer.getStrokes())
+                points += stroke.getNumPoints();
+        }
+    }
+    out << "format: " << (isNativeFile(fileName) ? "native" : "xournal") << "\n"
+        << "pages: " << document.getNumPages() << "\n"
+        << "layers: " << layers << "\n"
+        << "strokes: " << strokes << "\n"
+        << "points: " << points << "\n"
+        << "load time: " << loadTime << " ms\n";
+    return 0;
+}
+
+static int load(const QString &fileName)
+{
+    static const char *modeNames[] = {"all pages", "lazily", "in parallel"};
+    ScribbleDocument::LoadMode modes[] = {
+        ScribbleDocument::LOAD_ALL_PAGES, ScribbleDocument::LOAD_PAGES_LAZILY,
+        ScribbleDocument::LOAD_PAGES_IN_PARALLEL
+    };
+    for (int i = 0; i < 3; i ++) {
+        ScribbleDocument document;
+        QElapsedTimer timer;
+        timer.start();
+        if (!loadDocument(&document, fileName, modes[i])) {
+            err << "Could not load " << fileName << "\n";
+            return 1;
+        }
+        out << "load " << modeNames[i] << ": " << timer.elapsed() << " ms\n";
+    }
+    return 0;
+}
+
+static int save(const QString &fileName, const QString &outputName, bool convert)
+{
+    ScribbleDocument document;
+    QElapsedTimer timer;
+    timer.start();
+    if (!loadDocument(&document, fileName, ScribbleDocument::LOAD_PAGES_LAZILY)) {
+        err << "Could not load " << fileName << "\n";
+        return 1;
+    }
+    qint64 loadTime = timer.restart();
+    bool native = isNativeFile(fileName) != convert;
+    if (!writeDocument(&document, outputName, native)) {
+        err << "Could not write " << outputName << "\n";
+        return 1;
+    }
+    out << "load: " << loadTime << " ms\n"
+        << "write " << (native ? "native" : "xournal") << ": " << timer.elapsed() << " ms\n";
+    return 0;
+}
+
+static int simplify(const QString &fileName, const QString &outputName, const QString &toleranceArg)
+{
+    bool ok = true;
+    qreal tolerance = toleranceArg.isEmpty() ? 0.25 : toleranceArg.toDouble(&ok);
+    if (!ok || tolerance <= 0) {
+        err << "Invalid tolerance " << toleranceArg << "\n";
+        return 1;
+    }
+    ScribbleDocument document;
+    QElapsedTimer timer;
+    timer.start();
+    if (!loadDocument(&document, fileName, ScribbleDocument::LOAD_PAGES_IN_PARALLEL)) {
+        err << "Could not load " << fileName << "\n";
+        return 1;
+    }
+    qint64 loadTime = timer.restart();
+    int before, after;
+    document.simplifyAllStrokes(tolerance, &before, &after);
+    qint64 simplifyTime = timer.restart();
+    if (!writeDocument(&document, outputName, isNativeFile(fileName))) {
+        err << "Could not write " << outputName << "\n";
+        return 1;
+    }
+    out << "points: " << before << " before, " << after << " after\n"
+        << "load: " << loadTime << " ms\n"
+        << "simplify: " << simplifyTime << " ms\n"
+        << "write: " << timer.elapsed() << " ms\n";
+    return 0;
+}
+
+static int render(const QString &fileName, const QString &pageArg, const QString &outputName)
+{
+    ScribbleDocument document;
+    if (!loadDocument(&document, fileName, ScribbleDocument::LOAD_PAGES_LAZILY)) {
+        err << "Could not load " << fileName << "\n";
+        return 1;
+    }
+    bool ok;
+    int pageIndex = pageArg.toInt(&ok) - 1;
+    if (!ok || !document.setCurrentPage(pageIndex)) {
+        err << "Invalid page " << pageArg << "\n";
+        return 1;
+    }
+    const ScribblePage &page = document.getCurrentPage();
+
+    QElapsedTimer timer;
+    timer.start();
+    /* gray scale, see SpanRasterizer */
+    QImage image(page.size.toSize(), QImage::Format_Indexed8);
+    QVector<QRgb> colors;
+    for (int i = 0; i < 256; i ++)
+        colors.append(qRgb(i, i, i));
+    image.setColorTable(colors);
+    image.fill(255);
+    ScribbleGraphicsContext ctx(&image, QPoint(0, 0), QRegion(image.rect()), false);
+    ctx.drawPage(page, page.layers.length() - 1);
+    qint64 renderTime = timer.elapsed();
+
+    if (!image.save(outputName)) {
+        err << "Could not write " << outputName << "\n";
+        return 1;
+    }
+    out << "render: " << renderTime << " ms\n";
+    return 0;
+}
+
+/* Erases along short random movements over a page of many small strokes
+ * (like handwriting), through the same path as the touch samples take. */
+static int benchErase(int numStrokes)
+{
+    qsrand(1);
+    QByteArray xml = "<?xml version=\"1.0\" standalone=\"no\"?>\n<xournal version=\"0.4.5\">\n"
+            "<title>scribble-tool</title>\n<page width=\"612.00\" height=\"792.00\">\n"
+            "<background type=\"solid\" color=\"white\" style=\"plain\" />\n<layer>\n";
+    const int strokePoints = 20;
+    float x[strokePoints], y[strokePoints];
+    for (int i = 0; i < numStrokes; i ++) {
+        x[0] = 20 + qrand() % 572;
+        y[0] = 20 + qrand() % 752;
+        for (int j = 1; j < strokePoints; j ++) {
+            x[j] = x[j - 1] + (qrand() % 9 - 4) * 0.5f;
+            y[j] = y[j - 1] + (qrand() % 9 - 4) * 0.5f;
+        }
+        xml += "<stroke tool=\"pen\" color=\"black\" width=\"1.41\">\n";
+        CoordinateCodec::appendPoints(xml, x, y, strokePoints);
+        xml += "\n</stroke>\n";
+    }
+    xml += "</layer>\n</page>\n</xournal>\n";
+
+    ScribbleDocument document;
+    if (!document.loadXournalFile(xml)) {
+        err << "Could not create the document\n";
+        return 1;
+    }
+    document.setViewSize(QSize(612, 792));
+    document.useEraser();
+    int strokesBefore = document.getCurrentPage().layers.last().getNumStrokes();
+
+    /* every movement is undone separately, the samples come in batches
+     * and the eraser runs once per batch (from the event loop) */
+    const int movements = 200;
+    const int batches = 10;
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < movements; i ++) {
+        QPoint p(20 + qrand() % 572, 20 + qrand() % 752);
+        for (int j = 0; j < batches; j ++) {
+            QPolygon samples;
+            for (int k = 0; k < 4; k ++) {
+                p += QPoint(qrand() % 7 - 3, qrand() % 7 - 3);
+                samples << p;
+            }
+            document.touchEventDataReceived(samples, 1);
+            QCoreApplication::processEvents();
+        }
+        document.touchEventDataReceived(p, 0);
+    }
+    qint64 eraseTime = timer.elapsed();
+
+    out << "strokes: " << strokesBefore << ", "
+        << document.getCurrentPage().layers.last().getNumStrokes() << " after erasing\n"
+        << "erase: " << eraseTime << " ms for " << movements * batches << " eraser updates ("
+        << double(eraseTime) * 1000 / (movements * batches) << " us each)\n";
+    return 0;
+}
+
+static qint64 pointsPerSecond(int points, qint64 bestNanoseconds)
+{
+    return bestNanoseconds <= 0 ? 0 : qint64(points) * 1000000000 / bestNanoseconds;
+}
+
+/* Formats and parses the coordinates of a large stroke with
+ * CoordinateCodec, the best of a few rounds counts. */
+static int benchParse(int numPoints)
+{
+    qsrand(1);
+    QVector<float> x(numPoints), y(numPoints);
+    for (int i = 0; i < numPoints; i ++) {
+        x[i] = (qrand() % 61200) / 100.0f;
+        y[i] = (qrand() % 79200) / 100.0f;
+    }
+
+    const int rounds = 5;
+    QByteArray text;
+    qint64 formatTime = -1, parseTime = -1, toFloatTime = -1;
+    for (int r = 0; r < rounds; r ++) {
+        QElapsedTimer timer;
+        timer.start();
+        text.clear();
+        CoordinateCodec::appendPoints(text, x.constData(), y.constData(), numPoints);
+        qint64 t = timer.nsecsElapsed();
+        formatTime = formatTime < 0 ? t : qMin(formatTime, t);
+
+        QVector<float> xs, ys;
+        timer.restart();
+        bool ok = CoordinateCodec::parsePoints(text.constData(), text.constData() + text.size(), &xs, &ys);
+        t = timer.nsecsElapsed();
+        parseTime = parseTime < 0 ? t : qMin(parseTime, t);
+        if (!ok || xs.size() != numPoints) {
+            err << "Parsed " << xs.size() << " of " << numPoints << " points\n";
+            return 1;
+        }
+
+        /* splitting and QByteArray::toFloat, for comparison */
+        timer.restart();
+        QList<QByteArray> numbers = text.split(' ');
+        xs.clear();
+        ys.clear();
+        for (int i = 0; i + 1 < numbers.size(); i += 2) {
+            xs.append(numbers[i].toFloat());
+            ys.append(numbers[i + 1].toFloat());
+        }
+        t = timer.nsecsElapsed();
+        toFloatTime = toFloatTime < 0 ? t : qMin(toFloatTime, t);
+    }
+
+    out << "points: " << numPoints << " (" << text.size() << " bytes)\n"
+        << "format: " << pointsPerSecond(numPoints, formatTime) << " points/s\n"
+        << "parse: " << pointsPerSecond(numPoints, parseTime) << " points/s\n"
+        << "split and toFloat: " << pointsPerSecond(numPoints, toFloatTime) << " points/s\n";
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QStringList args = app.arguments().mid(1);
+    QString command = args.isEmpty() ? QString() : args.takeFirst();
+
+    if (command == "stats" && args.length() == 1)
+        return stats(args[0]);
+    else if (command == "load" && args.length() == 1)
+        return load(args[0]);
+    else if (command == "save" && args.length() == 2)
+        return save(args[0], args[1], false);
+    else if (command == "convert" && args.length() == 2)
+        return save(args[0], args[1], true);
+    else if (command == "simplify" && (args.length() == 2 || args.length() == 3))
+        return simplify(args[0], args[1], args.value(2));
+    else if (command == "render" && args.length() == 3)
+        return render(args[0], args[1], args[2]);
+    else if (command == "bench-erase" && args.length() <= 1)
+        return benchErase(args.isEmpty() ? 10000 : args[0].toInt());
+    else if (command == "bench-parse" && args.length() <= 1)
+        return benchParse(args.isEmpty() ? 1000000 : args[0].toInt());
+    usage();
+    return 2;
+}
@@ -0,0 +1,104 @@
+/*
+ * scribble: Scribbling Application for Onyx Boox M92
+ *
+ * Copyright (C) 2012 peter-x
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "touch_input.h"
+
+bool TouchSampleQueue::push(const TouchSample &sample)
+{
+    int h = head;
+    /* acquire, the consumer has to be done with the slot */
+    int t = tail.fetchAndAddAcquire(0);
+    int d = (h - t) & counterMask;
+    bool pressed = sample.pressure > 0;
+    int limit = pressed != lastPressed ? capacity : capacity - 2;
+    if (d >= limit) {
+        dropped.fetchAndAddRelaxed(1);
+        return false;
+    }
+    samples[h & (capacity - 1)] = sample;
+    /* release, the sample is written before it is published */
+    head.fetchAndStoreRelease((h + 1) & counterMask);
+    lastPressed = pressed;
+
+    if (d + 1 > maxDepth)
+        maxDepth.fetchAndStoreRelaxed(d + 1);
+    return true;
+}
+
+bool TouchSampleQueue::pop(TouchSample *sample)
+{
+    int t = tail;
+    int h = head.fetchAndAddAcquire(0);
+    if (h == t)
+        return false;
+    *sample = samples[t & (capacity - 1)];
+    tail.fetchAndStoreRelease((t + 1) & counterMask);
+    return true;
+}
+
+/* --------------------------------------------------------------- */
+
+TouchSampleReceiver::TouchSampleReceiver(TouchSampleQueue *queue, const QElapsedTimer *clock,
+                                         QAtomicInt *notificationPending) :
+    queue(queue), clock(clock), notificationPending(notificationPending)
+{
+}
+
+void TouchSampleReceiver::touchDataReceived(TouchData &data)
+{
+    TouchSample sample;
+    sample.x = data.points[0].x;
+    sample.y = data.points[0].y;
+    sample.pressure = data.points[0].pressure;
+    sample.time = clock->elapsed();
+    if (!queue->push(sample))
+        return;
+    /* Ordered, so that either the consumer still sees the sample after
+     * clearing the flag or this notifies it again. */
+    if (notificationPending->testAndSetOrdered(0, 1))
+        emit samplesAvailable();
+}
+
+/* --------------------------------------------------------------- */
+
+TouchInputThread::TouchInputThread(QObject *parent) :
+    QThread(parent), notificationPending(0)
+{
+    clock.start();
+}
+
+TouchInputThread::~TouchInputThread()
+{
+    quit();
+    wait();
+}
+
+void TouchInputThread::run()
+{
+    TouchEventListener listener;
+    TouchSampleReceiver r(&queue, &clock, &notificationPending);
+    connect(&listener, SIGNAL(touchData(TouchData &)), &r, SLOT(touchDataReceived(TouchData &)),
+            Qt::DirectConnection);
+    /* this object lives in the thread that created it, the signal is
+     * delivered there */
+    connect(&r, SIGNAL(samplesAvailable()), this, SIGNAL(samplesAvailable()));
+
+    exec();
+}
@@ -0,0 +1,131 @@
+/*
+ * scribble: Scribbling Application for Onyx Boox M92
+ *
+ * Copyright (C) 2012 peter-x
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef TOUCH_INPUT_H
+#define TOUCH_INPUT_H
+
+#include <QAtomicInt>
+#include <QElapsedTimer>
+#include <QThread>
+
+#include <onyx/touch/touch_listener.h>
+
+/* a touch sample in global coordinates with the time it was received */
+struct TouchSample
+{
+    int x;
+    int y;
+    int pressure;
+    /* milliseconds, see TouchInputThread::now() */
+    qint64 time;
+};
+
+/* Lock-free ring buffer of touch samples for exactly one producer and
+ * one consumer thread. */
+class TouchSampleQueue
+{
+public:
+    static const int capacity = 1024;
+
+    TouchSampleQueue() : head(0), tail(0), dropped(0), maxDepth(0), lastPressed(false) {}
+
+    /* Producer only, drops the sample if the queue is full. The last two
+     * slots are kept for samples that put the pen down or lift it, so
+     * that a stroke still ends (and the next one starts) when the
+     * consumer does not keep up. */
+    bool push(const TouchSample &sample);
+    /* consumer only, returns false if the queue is empty */
+    bool pop(TouchSample *sample);
+
+    /* samples dropped because the consumer did not keep up */
+    int droppedSamples() const { return dropped; }
+    int depth() const { return (int(head) - int(tail)) & counterMask; }
+    /* the largest number of samples that were queued at once */
+    int maxDepthSeen() const { return maxDepth; }
+
+private:
+    /* the counters wrap at twice the capacity, so that a full queue can
+     * be told from an empty one */
+    static const int counterMask = 2 * capacity - 1;
+
+    TouchSample samples[capacity];
+    /* the slot is the counter modulo capacity; head is only written by
+     * the producer and tail by the consumer */
+    QAtomicInt head;
+    QAtomicInt tail;
+    QAtomicInt dropped;
+    QAtomicInt maxDepth;
+    /* producer only, whether the last queued sample had pressure */
+    bool lastPressed;
+};
+
+/* receives the samples of a TouchEventListener in the input thread */
+class TouchSampleReceiver : public QObject
+{
+    Q_OBJECT
+public:
+    /* samplesAvailable() is only emitted if notificationPending is 0, the
+     * consumer resets it before it empties the queue */
+    TouchSampleReceiver(TouchSampleQueue *queue, const QElapsedTimer *clock, QAtomicInt *notificationPending);
+
+signals:
+    void samplesAvailable();
+
+public slots:
+    void touchDataReceived(TouchData &data);
+
+private:
+    TouchSampleQueue *queue;
+    const QElapsedTimer *clock;
+    QAtomicInt *notificationPending;
+};
+
+/* Reads the touch screen in its own thread, so that samples are neither
+ * lost nor delayed while the UI thread is busy. The samples are queued
+ * and samplesAvailable() is emitted (in the thread of this object) when
+ * they have to be taken with takeSample(). */
+class TouchInputThread : public QThread
+{
+    Q_OBJECT
+public:
+    explicit TouchInputThread(QObject *parent = 0);
+    ~TouchInputThread();
+
+    /* the time base of TouchSample::time */
+    qint64 now() const { return clock.elapsed(); }
+    bool takeSample(TouchSample *sample) { return queue.pop(sample); }
+    /* has to be called before taking the samples after samplesAvailable() */
+    void startTaking() { notificationPending.fetchAndStoreOrdered(0); }
+
+    const TouchSampleQueue &getQueue() const { return queue; }
+
+signals:
+    void samplesAvailable();
+
+protected:
+    void run();
+
+private:
+    TouchSampleQueue queue;
+    QElapsedTimer clock;
+    QAtomicInt notificationPending;
+};
+
+#endif // TOUCH_INPUT_H
@@ -0,0 +1,665 @@
+/*
+ * scribble: Scribbling Application for Onyx Boox M92
+ *
+ * Copyright (C) 2012 peter-x
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "xournal_parser.h"
+
+#include <QColor>
+#include <QPen>
+#include <QtDebug>
+
+#include <cstring>
+#include <limits>
+
+#include "coordinate_codec.h"
+
+static inline bool isSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static inline bool startsWith(const char *pos, const char *end, const char *literal)
+{
+    int length = strlen(literal);
+    return end - pos >= length && memcmp(pos, literal, length) == 0;
+}
+
+static inline bool equals(const char *str, int length, const char *literal)
+{
+    return int(strlen(literal)) == length && memcmp(str, literal, length) == 0;
+}
+
+/* returns the position of literal in [pos, end) or 0 */
+static const char *find(const char *pos, const char *end, const char *literal)
+{
+    int length = strlen(literal);
+    while (end - pos >= length) {
+        const char *p = static_cast<const char *>(memchr(pos, literal[0], end - pos - length + 1));
+        if (p == 0)
+            return 0;
+        if (memcmp(p, literal, length) == 0)
+            return p;
+        pos = p + 1;
+    }
+    return 0;
+}
+
+/* Returns the unicode character referenced by the entity between '&'
+ * and ';' or 0 if it is not one of the predefined entities or a
+ * character reference. */
+static uint entityValue(const char *begin, const char *end)
+{
+    int length = end - begin;
+    if (equals(begin, length, "lt")) return '<';
+    if (equals(begin, length, "gt")) return '>';
+    if (equals(begin, length, "amp")) return '&';
+    if (equals(begin, length, "quot")) return '"';
+    if (equals(begin, length, "apos")) return '\'';
+    if (length < 2 || begin[0] != '#')
+        return 0;
+
+    bool ok;
+    uint value;
+    if (begin[1] == 'x')
+        value = QByteArray(begin + 2, length - 2).toUInt(&ok, 16);
+    else
+        value = QByteArray(begin + 1, length - 1).toUInt(&ok, 10);
+    if (!ok || value > 0x10ffff)
+        return 0;
+    return value;
+}
+
+static const char *parseColor(const QByteArray &color, QColor *result)
+{
+    static const struct {
+        const char *name;
+        const char *value;
+    } xournalColors[] = {
+        {"black", "#000000"},
+        {"blue", "#3333cc"},
+        {"red", "#ff0000"},
+        {"green", "#008000"},
+        {"gray", "#808080"},
+        {"lightblue", "#00c0ff"},
+        {"lightgreen", "#00ff00"},
+        {"magenta", "#ff00ff"},
+        {"orange", "#ff8000"},
+        {"yellow", "#ffff00"},
+        {"white", "#ffffff"}
+    };
+
+    for (unsigned int i = 0; i < sizeof(xournalColors) / sizeof(xournalColors[0]); i ++) {
+        if (color == xournalColors[i].name) {
+            *result = QColor(xournalColors[i].value);
+            return 0;
+        }
+    }
+
+    if (!color.startsWith('#'))
+        return "Document uses invalid color specification.";
+
+    bool ok;
+    quint32 col = QString::fromUtf8(color.constData() + 1, color.size() - 1).toUInt(&ok, 16);
+    if (!ok)
+        return "Document uses invalid color format.";
+    *result = QColor((col >> 24) & 0xff, (col >> 16) & 0xff,
+                     (col >>  8) & 0xff,  col        & 0xff);
+    return 0;
+}
+
+/* ---------------------------------------------------------------- */
+
+XournalParser::XournalParser() :
+    begin(0), end(0), pos(0), lazyPages(false), rootSeen(false), numAttributes(0),
+    currentElement(NO_ELEMENT), strokeTextBegin(0), strokeTextEnd(0), strokeTextRanges(0)
+{
+}
+
+XournalParser::Result XournalParser::parse(const QByteArray &data, bool lazyPages)
+{
+    begin = data.constData();
+    end = begin + data.size();
+    pos = begin;
+    this->lazyPages = lazyPages;
+
+    openElements.clear();
+    rootSeen = false;
+    numAttributes = 0;
+    errorStr.clear();
+    title.clear();
+    pages.clear();
+    currentElement = NO_ELEMENT;
+    strokeTextRanges = 0;
+    strokeTextCopy.clear();
+
+    if (startsWith(pos, end, "\xef\xbb\xbf")) {
+        pos += 3;
+    } else if (startsWith(pos, end, "\xfe\xff") || startsWith(pos, end, "\xff\xfe")) {
+        return UNSUPPORTED;
+    }
+
+    while (pos < end) {
+        const char *tag = static_cast<const char *>(memchr(pos, '<', end - pos));
+        const char *textEnd = tag != 0 ? tag : end;
+        if (textEnd > pos) {
+            Result r = characters(pos, textEnd);
+            if (r != OK)
+                return r;
+        }
+        if (tag == 0)
+            break;
+        pos = tag;
+
+        Result r;
+        if (startsWith(pos, end, "<!--")) {
+            const char *commentEnd = find(pos + 4, end, "-->");
+            if (commentEnd == 0)
+                return fatalError("unexpected end of file", end);
+            pos = commentEnd + 3;
+            continue;
+        } else if (startsWith(pos, end, "<?")) {
+            const char *piEnd = find(pos + 2, end, "?>");
+            if (piEnd == 0)
+                return fatalError("unexpected end of file", end);
+            if (startsWith(pos, piEnd, "<?xml") && pos + 5 < piEnd && isSpace(pos[5])) {
+                const char *encoding = find(pos + 5, piEnd, "encoding");
+                if (encoding != 0) {
+                    const char *quote = encoding + 8;
+                    while (quote < piEnd && *quote != '"' && *quote != '\'')
+                        quote ++;
+                    const char *valueEnd = quote < piEnd ? static_cast<const char *>(memchr(quote + 1, *quote, piEnd - quote - 1)) : 0;
+                    if (valueEnd == 0 || QByteArray(quote + 1, valueEnd - quote - 1).toUpper() != "UTF-8")
+                        return UNSUPPORTED;
+                }
+            }
+            pos = piEnd + 2;
+            continue;
+        } else if (startsWith(pos, end, "<!")) {
+            /* DOCTYPE or CDATA */
+            return UNSUPPORTED;
+        } else if (startsWith(pos, end, "</")) {
+            r = parseEndTag();
+        } else {
+            r = parseStartTag();
+        }
+        if (r != OK)
+            return r;
+    }
+
+    if (!rootSeen) {
+        parseError("Document is empty.");
+        return fatalError("unexpected end of file", end);
+    }
+    if (!openElements.isEmpty())
+        return fatalError("unexpected end of file", end);
+
+    endDocument();
+    return OK;
+}
+
+XournalParser::Result XournalParser::parseStartTag()
+{
+    const char *tagStart = pos;
+    const char *name = pos + 1;
+    const char *nameEnd = name;
+    while (nameEnd < end && !isSpace(*nameEnd) && *nameEnd != '/' && *nameEnd != '>')
+        nameEnd ++;
+    if (nameEnd >= end)
+        return fatalError("unexpected end of file", end);
+    if (nameEnd == name)
+        return fatalError("error occurred while parsing element", tagStart);
+    if (memchr(name, ':', nameEnd - name) != 0)
+        return UNSUPPORTED;
+    if (rootSeen && openElements.isEmpty())
+        return fatalError("unexpected content after the root element", tagStart);
+
+    pos = nameEnd;
+    const char *tagEnd;
+    bool emptyElement;
+    Result r = parseAttributes(&tagEnd, &emptyElement);
+    if (r != OK)
+        return r;
+    rootSeen = true;
+
+    int length = nameEnd - name;
+    if (!startElement(name, length))
+        return fatalError(errorStr, tagStart);
+    if (emptyElement) {
+        if (!endElement(name, length))
+            return fatalError(errorStr, tagStart);
+    } else if (lazyPages && openElements.size() == 1 && equals(name, length, "page")) {
+        pos = tagEnd;
+        currentElement = NO_ELEMENT;
+        return skipPage(tagStart);
+    } else {
+        openElements.append(qMakePair(name, length));
+    }
+    pos = tagEnd;
+    return OK;
+}
+
+XournalParser::Result XournalParser::parseEndTag()
+{
+    const char *tagStart = pos;
+    const char *name = pos + 2;
+    const char *nameEnd = name;
+    while (nameEnd < end && !isSpace(*nameEnd) && *nameEnd != '>')
+        nameEnd ++;
+    const char *p = nameEnd;
+    while (p < end && isSpace(*p))
+        p ++;
+    if (p >= end)
+        return fatalError("unexpected end of file", end);
+    if (*p != '>')
+        return fatalError("unexpected character", p);
+
+    int length = nameEnd - name;
+    if (openElements.isEmpty() || openElements.last().second != length ||
+            memcmp(openElements.last().first, name, length) != 0)
+        return fatalError("tag mismatch", tagStart);
+    openElements.remove(openElements.size() - 1);
+
+    pos = p + 1;
+    if (!endElement(name, length))
+        return fatalError(errorStr, tagStart);
+    return OK;
+}
+
+XournalParser::Result XournalParser::skipPage(const char *tagStart)
+{
+    const char *p = pos;
+    forever {
+        p = static_cast<const char *>(memchr(p, '<', end - p));
+        if (p == 0)
+            return fatalError("unexpected end of file", end);
+        if (startsWith(p, end, "<!--")) {
+            const char *commentEnd = find(p + 4, end, "-->");
+            if (commentEnd == 0)
+                return fatalError("unexpected end of file", end);
+            p = commentEnd + 3;
+        } else if (startsWith(p, end, "<?")) {
+            const char *piEnd = find(p + 2, end, "?>");
+            if (piEnd == 0)
+                return fatalError("unexpected end of file", end);
+            p = piEnd + 2;
+        } else if (startsWith(p, end, "<!")) {
+            return UNSUPPORTED;
+        } else if (startsWith(p, end, "</page") && p + 6 < end && (isSpace(p[6]) || p[6] == '>')) {
+            const char *tagEnd = static_cast<const char *>(memchr(p, '>', end - p));
+            if (tagEnd == 0)
+                return fatalError("unexpected end of file", end);
+            pos = tagEnd + 1;
+            pages.last().setUnloaded(QByteArray(tagStart, pos - tagStart) + '\n');
+            return OK;
+        } else if (startsWith(p, end, "<page") && p + 5 < end &&
+                   (isSpace(p[5]) || p[5] == '>' || p[5] == '/')) {
+            /* nested pages are not delimited correctly */
+            return UNSUPPORTED;
+        } else {
+            p ++;
+        }
+    }
+}
+
+XournalParser::Result XournalParser::parseAttributes(const char **tagEnd, bool *emptyElement)
+{
+    numAttributes = 0;
+    forever {
+        bool spaceBefore = false;
+        while (pos < end && isSpace(*pos)) {
+            pos ++;
+            spaceBefore = true;
+        }
+        if (pos >= end)
+            return fatalError("unexpected end of file", end);
+        if (*pos == '>') {
+            *tagEnd = pos + 1;
+            *emptyElement = false;
+            return OK;
+        }
+        if (*pos == '/') {
+            if (pos + 1 < end && pos[1] == '>') {
+                *tagEnd = pos + 2;
+                *emptyElement = true;
+                return OK;
+            }
+            return fatalError("unexpected character", pos);
+        }
+        if (!spaceBefore)
+            return fatalError("unexpected character", pos);
+
+        Attribute &a = attributes[numAttributes];
+        a.name = pos;
+        while (pos < end && !isSpace(*pos) && *pos != '=' && *pos != '>' && *pos != '/')
+            pos ++;
+        a.nameLength = pos - a.name;
+        while (pos < end && isSpace(*pos))
+            pos ++;
+        if (pos >= end)
+            return fatalError("unexpected end of file", end);
+        if (a.nameLength == 0 || *pos != '=')
+            return fatalError("error occurred while parsing attribute", pos);
+        pos ++;
+        while (pos < end && isSpace(*pos))
+            pos ++;
+        if (pos >= end)
+            return fatalError("unexpected end of file", end);
+        if (*pos != '"' && *pos != '\'')
+            return fatalError("error occurred while parsing attribute", pos);
+        const char *valueEnd = static_cast<const char *>(memchr(pos + 1, *pos, end - pos - 1));
+        if (valueEnd == 0)
+            return fatalError("unexpected end of file", end);
+        a.value = pos + 1;
+        a.valueLength = valueEnd - a.value;
+        if (memchr(a.value, '<', a.valueLength) != 0)
+            return fatalError("unexpected character", a.value);
+        a.needsDecoding = false;
+        for (int i = 0; i < a.valueLength; i ++) {
+            char c = a.value[i];
+            if (c == '&' || c == '\t' || c == '\n' || c == '\r') {
+                a.needsDecoding = true;
+                break;
+            }
+        }
+        if (a.needsDecoding && !checkEntities(a.value, valueEnd))
+            return UNSUPPORTED;
+        pos = valueEnd + 1;
+
+        for (int i = 0; i < numAttributes; i ++) {
+            if (attributes[i].nameLength == a.nameLength &&
+                    memcmp(attributes[i].name, a.name, a.nameLength) == 0)
+                return fatalError("attribute redefined", a.name);
+        }
+        numAttributes ++;
+        if (numAttributes >= maxAttributes)
+            return UNSUPPORTED;
+    }
+}
+
+XournalParser::Result XournalParser::characters(const char *textBegin, const char *textEnd)
+{
+    if (openElements.isEmpty()) {
+        for (const char *p = textBegin; p < textEnd; p ++) {
+            if (!isSpace(*p))
+                return fatalError("text outside of the root element", p);
+        }
+        return OK;
+    }
+
+    if (currentElement == STROKE) {
+        if (memchr(textBegin, '&', textEnd - textBegin) != 0)
+            return UNSUPPORTED;
+        if (strokeTextRanges == 0) {
+            strokeTextBegin = textBegin;
+            strokeTextEnd = textEnd;
+        } else {
+            if (strokeTextRanges == 1)
+                strokeTextCopy = QByteArray(strokeTextBegin, strokeTextEnd - strokeTextBegin);
+            strokeTextCopy.append(textBegin, textEnd - textBegin);
+        }
+        strokeTextRanges ++;
+    } else if (currentElement == TITLE) {
+        if (!checkEntities(textBegin, textEnd))
+            return UNSUPPORTED;
+        title += QString::fromUtf8(decode(textBegin, textEnd, false));
+    }
+    return OK;
+}
+
+bool XournalParser::startElement(const char *name, int length)
+{
+    Element element = OTHER_ELEMENT;
+    if (equals(name, length, "stroke")) {
+        if (!startStroke())
+            return false;
+        element = STROKE;
+    } else if (equals(name, length, "page")) {
+        if (!startPage())
+            return false;
+    } else if (equals(name, length, "background")) {
+        if (pages.isEmpty()) {
+            parseError("Document contains invalid elements.");
+            return false;
+        }
+        ScribblePage &p(pages.last());
+        p.background.type = attributeString("type");
+        p.background.color = attributeString("color");
+        p.background.style = attributeString("style");
+        p.background.domain = attributeString("domain");
+        p.background.filename = attributeString("filename");
+        p.background.pageno = attributeString("pageno");
+    } else if (equals(name, length, "layer")) {
+        if (pages.isEmpty()) {
+            parseError("Document contains invalid elements.");
+            return false;
+        }
+        pages.last().layers.append(ScribbleLayer());
+    } else if (equals(name, length, "title")) {
+        title.clear();
+        element = TITLE;
+    } else if (equals(name, length, "xournal")) {
+    } else {
+        parseError("Document contains invalid elements.");
+        return false;
+    }
+    currentElement = element;
+    return true;
+}
+
+bool XournalParser::startStroke()
+{
+    int tool = findAttribute("tool");
+    if (tool < 0 || attributeValue(tool) != "pen") {
+        parseError("Document uses tools that are not pens.");
+        return false;
+    }
+
+    int colorIndex = findAttribute("color");
+    QColor color;
+    const char *error = parseColor(colorIndex < 0 ? QByteArray() : attributeValue(colorIndex), &color);
+    if (error != 0) {
+        parseError(error);
+        return false;
+    }
+
+    QPen pen;
+    pen.setColor(color);
+    bool ok;
+    pen.setWidthF(attributeFloat("width", &ok));
+    if (!ok) {
+        parseError("Document uses invalid pen width.");
+        return false;
+    }
+    /* XXX variable width (multiple float values separated by whitespace) */
+
+    if (pages.isEmpty() || pages.last().layers.isEmpty()) {
+        parseError("Document contains invalid elements.");
+        return false;
+    }
+    currentStroke = ScribbleStroke();
+    currentStroke.setPen(pen);
+    strokeTextRanges = 0;
+    strokeTextCopy.clear();
+    return true;
+}
+
+bool XournalParser::startPage()
+{
+    ScribblePage p;
+    bool ok1, ok2;
+    p.size = QSizeF(attributeFloat("width", &ok1), attributeFloat("height", &ok2));
+    if (!ok1 || !ok2) {
+        parseError("Document uses invalid page size.");
+        return false;
+    }
+    pages.append(p);
+    return true;
+}
+
+bool XournalParser::endElement(const char *name, int length)
+{
+    if (equals(name, length, "stroke")) {
+        if (!endStroke())
+            return false;
+    }
+    currentElement = NO_ELEMENT;
+    return true;
+}
+
+bool XournalParser::endStroke()
+{
+    const char *text = 0;
+    const char *textEnd = 0;
+    if (strokeTextRanges == 1) {
+        text = strokeTextBegin;
+        textEnd = strokeTextEnd;
+    } else if (strokeTextRanges > 1) {
+        text = strokeTextCopy.constData();
+        textEnd = text + strokeTextCopy.size();
+    }
+
+    QVector<float> xs;
+    QVector<float> ys;
+    if (!CoordinateCodec::parsePoints(text, textEnd, &xs, &ys)) {
+        parseError("Document contains invalid character in stroke description.");
+        return false;
+    }
+
+    if (pages.isEmpty() || pages.last().layers.isEmpty()) {
+        parseError("Document contains invalid elements.");
+        return false;
+    }
+    currentStroke.setPoints(xs, ys);
+    pages.last().layers.last().appendStroke(currentStroke);
+    strokeTextRanges = 0;
+    strokeTextCopy.clear();
+    return true;
+}
+
+void XournalParser::endDocument()
+{
+    if (pages.isEmpty()) {
+        pages.append(ScribblePage());
+    }
+    for (int i = 0; i < pages.length(); i ++) {
+        if (pages[i].isLoaded() && pages[i].layers.isEmpty()) {
+            pages[i].layers.append(ScribbleLayer());
+        }
+    }
+}
+
+int XournalParser::findAttribute(const char *name) const
+{
+    for (int i = 0; i < numAttributes; i ++) {
+        if (equals(attributes[i].name, attributes[i].nameLength, name))
+            return i;
+    }
+    return -1;
+}
+
+QByteArray XournalParser::attributeValue(int index) const
+{
+    const Attribute &a = attributes[index];
+    if (a.needsDecoding)
+        return decode(a.value, a.value + a.valueLength, true);
+    return QByteArray::fromRawData(a.value, a.valueLength);
+}
+
+QString XournalParser::attributeString(const char *name) const
+{
+    int index = findAttribute(name);
+    if (index < 0)
+        return QString();
+    QString value = QString::fromUtf8(attributeValue(index));
+    /* present but empty is not the same as not present */
+    return value.isNull() ? QString("") : value;
+}
+
+float XournalParser::attributeFloat(const char *name, bool *ok) const
+{
+    int index = findAttribute(name);
+    if (index < 0) {
+        *ok = false;
+        return 0;
+    }
+
+    /* same semantics as QString::toFloat */
+    double value = QString::fromUtf8(attributeValue(index)).toDouble(ok);
+    if (!*ok || value > std::numeric_limits<float>::max() || value < -std::numeric_limits<float>::max()) {
+        *ok = false;
+        return 0;
+    }
+    return float(value);
+}
+
+XournalParser::Result XournalParser::fatalError(const QString &message, const char *position)
+{
+    int line = 1;
+    const char *lineStart = begin;
+    for (const char *p = begin; p < position; p ++) {
+        if (*p == '\n') {
+            line ++;
+            lineStart = p + 1;
+        }
+    }
+    qWarning() << "Fatal error on line" << line
+               << ", column" << (position - lineStart + 1) << ":"
+               << message;
+    return ERROR;
+}
+
+bool XournalParser::checkEntities(const char *begin, const char *end)
+{
+    for (const char *p = begin; p < end; p ++) {
+        if (*p != '&')
+            continue;
+        const char *semicolon = static_cast<const char *>(memchr(p, ';', end - p));
+        if (semicolon == 0 || entityValue(p + 1, semicolon) == 0)
+            return false;
+        p = semicolon;
+    }
+    return true;
+}
+
+QByteArray XournalParser::decode(const char *begin, const char *end, bool normalizeWhitespace)
+{
+    QByteArray output;
+    output.reserve(end - begin);
+    for (const char *p = begin; p < end; p ++) {
+        char c = *p;
+        if (c == '\r') {
+            /* line ends are normalized to \n */
+            if (p + 1 < end && p[1] == '\n')
+                p ++;
+            c = '\n';
+        }
+        if (normalizeWhitespace && (c == '\n' || c == '\t'))
+            c = ' ';
+        if (c == '&') {
+            /* checked by checkEntities */
+            const char *semicolon = static_cast<const char *>(memchr(p, ';', end - p));
+            uint value = entityValue(p + 1, semicolon);
+            output += QString::fromUcs4(&value, 1).toUtf8();
+            p = semicolon;
+        } else {
+            output += c;
+        }
+    }
+    return output;
+}
@@ -0,0 +1,127 @@
+/*
+ * scribble: Scribbling Application for Onyx Boox M92
+ *
+ * Copyright (C) 2012 peter-x
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef XOURNAL_PARSER_H
+#define XOURNAL_PARSER_H
+
+#include <QByteArray>
+#include <QList>
+#include <QPair>
+#include <QString>
+#include <QVector>
+
+#include "scribble_document.h"
+
+/* Parser for the subset of XML used by Xournal files. It works directly
+ * on the UTF-8 bytes and produces the same pages and errors as
+ * XournalXMLHandler does with QXmlSimpleReader.
+ * Documents that use XML features outside of this subset (DOCTYPE,
+ * CDATA sections, namespace prefixes, encodings other than UTF-8) are
+ * reported as UNSUPPORTED and have to be parsed by QXmlSimpleReader. */
+class XournalParser
+{
+public:
+    enum Result {
+        OK, ERROR, UNSUPPORTED
+    };
+
+    XournalParser();
+    /* With lazyPages, the content of the pages is not parsed, the pages
+     * are only delimited and kept unloaded (see ScribblePage::setUnloaded).
+     * Errors inside of the pages are then only found when they are
+     * loaded. */
+    Result parse(const QByteArray &data, bool lazyPages = false);
+
+    QString getTitle() const { return title; }
+    QList<ScribblePage> getPages() const { return pages; }
+    QString errorString() const { return errorStr; }
+
+private:
+    struct Attribute {
+        const char *name;
+        int nameLength;
+        const char *value;
+        int valueLength;
+        /* contains entity references or characters that are normalized */
+        bool needsDecoding;
+    };
+
+    enum Element {
+        NO_ELEMENT, STROKE, TITLE, OTHER_ELEMENT
+    };
+
+    Result parseStartTag();
+    Result parseEndTag();
+    Result parseAttributes(const char **tagEnd, bool *emptyElement);
+    /* skips to the end of the page whose start tag ends at pos */
+    Result skipPage(const char *tagStart);
+    Result characters(const char *begin, const char *end);
+
+    bool startElement(const char *name, int length);
+    bool startStroke();
+    bool startPage();
+    bool endElement(const char *name, int length);
+    bool endStroke();
+    void endDocument();
+
+    int findAttribute(const char *name) const;
+    QByteArray attributeValue(int index) const;
+    /* the null string if the attribute does not exist */
+    QString attributeString(const char *name) const;
+    float attributeFloat(const char *name, bool *ok) const;
+
+    Result fatalError(const QString &message, const char *position);
+    void parseError(const QString &errorStr) {
+        if (this->errorStr.isEmpty())
+            this->errorStr = errorStr;
+    }
+
+    static bool checkEntities(const char *begin, const char *end);
+    static QByteArray decode(const char *begin, const char *end, bool normalizeWhitespace);
+
+    static const int maxAttributes = 32;
+
+    const char *begin;
+    const char *end;
+    const char *pos;
+    bool lazyPages;
+
+    /* names of the elements that are not yet closed */
+    QVector<QPair<const char *, int> > openElements;
+    bool rootSeen;
+
+    Attribute attributes[maxAttributes];
+    int numAttributes;
+
+    QString errorStr;
+    QString title;
+    QList<ScribblePage> pages;
+
+    Element currentElement;
+    ScribbleStroke currentStroke;
+    /* the text of the current stroke, usually a single range of the
+     * input, only copied if it is interrupted (e.g. by a comment) */
+    const char *strokeTextBegin;
+    const char *strokeTextEnd;
+    QByteArray strokeTextCopy;
+    int strokeTextRanges;
+};
+
+#endif // XOURNAL_PARSER_H